@@ -0,0 +1,345 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under the terms of the GNU Affero Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "BinaryLog.h"
+#include "Configuration.h"
+
+using namespace std;
+
+extern ConfigurationTable gConfig;
+
+
+/**@name Segment management. */
+//@{
+// A mapped segment file.  Writers count themselves in mWriters while they copy into the mapping,
+// and the segment is not unmapped until they are all done.
+// A writer may still be looking at one that has been replaced, so they are never freed; instead there is a
+// fixed pair, used alternately, and a slot is not reused until the segment in it has been retired.
+struct BinaryLogSegment {
+	BinaryLogHeader * volatile mHeader;	// NULL once retired.
+	uint64_t mSize;
+	volatile unsigned mSequence;
+	volatile int mWriters;
+};
+
+static BinaryLogSegment sBinarySegments[2];
+static BinaryLogSegment * volatile sBinarySegment = NULL;
+static Mutex sBinaryLock;			// Held while opening and retiring segments.
+static string sBinaryPath;			// Log.Binary.File; segment N is sBinaryPath.N
+static uint64_t sBinarySize;		// Log.Binary.SegmentSize
+static unsigned sBinaryKeep;		// Log.Binary.Segments
+static unsigned sBinarySequence = 0;	// The last segment number used.  It carries on after gBinaryLogClose so that
+										// a LogSite::mBinarySegment from before never matches a new segment.
+static volatile unsigned long sBinaryDropped = 0;
+
+static inline unsigned align8(unsigned len) { return (len + 7) & ~7u; }
+
+static string segmentName(unsigned sequence)
+{
+	char suffix[16];
+	snprintf(suffix,sizeof(suffix),".%u",sequence);
+	return sBinaryPath + suffix;
+}
+
+static BinaryLogSegment *segmentOpen(unsigned sequence)
+{
+	string name = segmentName(sequence);
+	int fd = open(name.c_str(),O_RDWR|O_CREAT|O_TRUNC,0644);
+	if (fd < 0) {
+		LOG(ERR) << "cannot open binary log segment " << name << ": " << strerror(errno);
+		return NULL;
+	}
+	void *map = MAP_FAILED;
+	if (ftruncate(fd,sBinarySize) == 0) {
+		map = mmap(NULL,sBinarySize,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	}
+	int err = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		LOG(ERR) << "cannot map binary log segment " << name << ": " << strerror(err);
+		unlink(name.c_str());
+		return NULL;
+	}
+	BinaryLogHeader *header = (BinaryLogHeader*) map;
+	memcpy(header->mMagic,sBinaryLogMagic,sizeof(header->mMagic));
+	header->mPid = getpid();
+	header->mSequence = sequence;
+	header->mSize = sBinarySize;
+	header->mUsed = align8(sizeof(BinaryLogHeader));
+
+	if (sequence > sBinaryKeep) { unlink(segmentName(sequence - sBinaryKeep).c_str()); }
+
+	// The other slot holds the current segment.  This one may still be retiring the segment before that,
+	// if the current one filled up quickly.  mWriters is left alone: writers that raced with a rollover
+	// may still count themselves in it briefly, and segmentAcquire sends them on their way.
+	BinaryLogSegment *seg = &sBinarySegments[sequence & 1];
+	while (seg->mHeader) { sched_yield(); }
+	seg->mSize = sBinarySize;
+	seg->mSequence = sequence;
+	__sync_synchronize();
+	seg->mHeader = header;
+	return seg;
+}
+
+// Called after seg has been replaced in sBinarySegment, by whoever replaced it.
+// This waits for the writers still copying into seg, so it is called without sBinaryLock.
+static void segmentRetire(BinaryLogSegment *seg, int syncFlag)
+{
+	__sync_synchronize();
+	while (seg->mWriters) { sched_yield(); }
+	msync(seg->mHeader,seg->mSize,syncFlag);
+	munmap(seg->mHeader,seg->mSize);
+	__sync_synchronize();
+	seg->mHeader = NULL;		// The slot can be reused.
+}
+
+// Switch to the next segment, unless another thread already has.
+// The sequence number tells a full segment from a later one in the same slot.
+static void segmentRollover(BinaryLogSegment *full, unsigned sequence)
+{
+	{
+		ScopedLock lock(sBinaryLock);
+		if (sBinarySegment != full || full->mSequence != sequence) return;
+		sBinarySegment = segmentOpen(++sBinarySequence);
+	}
+	segmentRetire(full,MS_ASYNC);
+}
+
+// Return the current segment with ourselves counted as a writer, or NULL.
+static BinaryLogSegment *segmentAcquire()
+{
+	while (1) {
+		BinaryLogSegment *seg = sBinarySegment;
+		if (seg == NULL) return NULL;
+		__sync_fetch_and_add(&seg->mWriters,1);
+		if (seg == sBinarySegment) return seg;
+		__sync_fetch_and_sub(&seg->mWriters,1);		// It was retired under us; try the new one.
+	}
+}
+
+static void segmentRelease(BinaryLogSegment *seg)
+{
+	__sync_fetch_and_sub(&seg->mWriters,1);
+}
+
+void gBinaryLogInit()
+{
+	ScopedLock lock(sBinaryLock);
+	if (sBinarySegment) return;
+	sBinaryPath = gConfig.getStr("Log.Binary.File");
+	if (sBinaryPath.empty()) return;
+	sBinarySize = gConfig.getNum("Log.Binary.SegmentSize");
+	sBinaryKeep = gConfig.getNum("Log.Binary.Segments");
+	static bool registered = false;
+	if (!registered) {
+		atexit(gBinaryLogClose);
+		registered = true;
+	}
+	sBinarySegment = segmentOpen(++sBinarySequence);
+}
+
+void gBinaryLogClose()
+{
+	BinaryLogSegment *seg;
+	{
+		ScopedLock lock(sBinaryLock);
+		seg = sBinarySegment;
+		if (seg == NULL) return;
+		sBinarySegment = NULL;
+	}
+	segmentRetire(seg,MS_SYNC);
+}
+
+unsigned long gBinaryLogDroppedCount() { return sBinaryDropped; }
+//@}
+
+
+/**@name Packing the record. */
+//@{
+bool BinaryLogRecord::reserve(unsigned needed)
+{
+	if (mCount < sMaxArgs && mLength + needed <= sizeof(mArgs)) return true;
+	mPendingName = NULL;
+	return false;
+}
+
+void BinaryLogRecord::putValue(BinaryLogArgType type, const void *value, unsigned size)
+{
+	if (!reserve(1+size)) return;
+	mArgs[mLength++] = type;
+	memcpy(mArgs+mLength,value,size);
+	mLength += size;
+	mNames[mCount++] = mPendingName;
+	mPendingName = NULL;
+}
+
+void BinaryLogRecord::putString(const char *text, unsigned len)
+{
+	if (!reserve(3)) return;
+	if (len > sizeof(mArgs) - mLength - 3) { len = sizeof(mArgs) - mLength - 3; }
+	uint16_t len16 = len;
+	mArgs[mLength++] = BLOG_STRING;
+	memcpy(mArgs+mLength,&len16,2);
+	memcpy(mArgs+mLength+2,text,len);
+	mLength += 2 + len;
+	mNames[mCount++] = mPendingName;
+	mPendingName = NULL;
+}
+
+BinaryLogRecord& BinaryLogRecord::operator<<(const char *val)
+{
+	if (val == NULL) { val = "(null)"; }
+	putString(val,strlen(val));
+	return *this;
+}
+
+static char *putDescriptionString(char *out, const char *text)
+{
+	uint16_t len = text ? strlen(text) : 0;
+	memcpy(out,&len,2);
+	if (len) { memcpy(out+2,text,len); }
+	return out + 2 + len;
+}
+
+BinaryLogRecord::~BinaryLogRecord()
+{
+	// Records that are only wanted by the flight recorder, and everything when there is no segment, go out as text.
+	BinaryLogSegment *seg = (mPriority <= mSite->mLevel) ? segmentAcquire() : NULL;
+	if (seg == NULL) {
+		Log record(mPriority,mSite);
+		gBinaryLogFormat(record.get(),mNames,mCount,mArgs,mLength);
+		return;
+	}
+
+	unsigned recordLength = align8(sizeof(BinaryLogEntry) + mLength);
+	unsigned siteLength;
+	bool describe;
+	uint64_t offset;
+	for (int attempt = 0; ; attempt++) {
+		// The first record from a site in each segment is preceded by a description of the site.
+		unsigned described = mSite->mBinarySegment;
+		describe = described != seg->mSequence && __sync_bool_compare_and_swap(&mSite->mBinarySegment,described,seg->mSequence);
+		siteLength = 0;
+		if (describe) {
+			siteLength = sizeof(BinaryLogEntry) + 4 + 2 + strlen(mSite->mFile) + 2 + strlen(mSite->mFunction);
+			for (unsigned i = 0; i < mCount; i++) { siteLength += 2 + (mNames[i] ? strlen(mNames[i]) : 0); }
+			siteLength = align8(siteLength);
+		}
+		offset = __sync_fetch_and_add(&seg->mHeader->mUsed,siteLength + recordLength);
+		if (offset + siteLength + recordLength <= seg->mSize) break;
+		// Full.  Whoever gets here first opens the next segment, and the record goes there.
+		if (describe) { mSite->mBinarySegment = 0; }
+		unsigned sequence = seg->mSequence;
+		segmentRelease(seg);
+		segmentRollover(seg,sequence);
+		seg = (attempt == 0) ? segmentAcquire() : NULL;
+		if (seg == NULL) {
+			// No segment could be opened, or the next one filled up too.
+			__sync_fetch_and_add(&sBinaryDropped,1);
+			return;
+		}
+	}
+
+	// The lengths go in first, so that LogDecode can step over the entries even if we never finish them.
+	char *base = (char*) seg->mHeader + offset;
+	if (describe) { ((BinaryLogEntry*) base)->mLength = siteLength; }
+	((BinaryLogEntry*) (base + siteLength))->mLength = recordLength;
+
+	struct timeval now;
+	gettimeofday(&now,NULL);
+	if (describe) {
+		BinaryLogEntry *entry = (BinaryLogEntry*) base;
+		entry->mPriority = mPriority;
+		entry->mSite = (uintptr_t) mSite;
+		entry->mTime = 0;
+		entry->mTid = 0;
+		entry->mCount = mCount;
+		char *out = base + sizeof(BinaryLogEntry);
+		uint32_t line = mSite->mLine;
+		memcpy(out,&line,4);
+		out = putDescriptionString(out+4,mSite->mFile);
+		out = putDescriptionString(out,mSite->mFunction);
+		for (unsigned i = 0; i < mCount; i++) { out = putDescriptionString(out,mNames[i]); }
+		__sync_synchronize();
+		entry->mType = BLOG_SITE;
+		base += siteLength;
+	}
+	BinaryLogEntry *entry = (BinaryLogEntry*) base;
+	entry->mPriority = mPriority;
+	entry->mSite = (uintptr_t) mSite;
+	entry->mTime = now.tv_sec * 1000000ULL + now.tv_usec;
+	entry->mTid = gettid();
+	entry->mCount = mCount;
+	memcpy(base + sizeof(BinaryLogEntry),mArgs,mLength);
+	__sync_synchronize();
+	entry->mType = BLOG_RECORD;
+	segmentRelease(seg);
+}
+//@}
+
+
+bool gBinaryLogFormat(std::ostream &os, const char *const *names, unsigned count, const char *args, unsigned len)
+{
+	const char *end = args + len;
+	for (unsigned i = 0; i < count; i++) {
+		if (args >= end) return false;
+		int type = *args++;
+		if (names && names[i]) { os << " " << names[i] << "="; }
+		unsigned size = (type == BLOG_CHAR || type == BLOG_BOOL) ? 1 : (type == BLOG_STRING) ? 2 : 8;
+		if ((unsigned)(end - args) < size) return false;
+		uint64_t u;
+		double d;
+		uint16_t n;
+		switch (type) {
+			case BLOG_INT: memcpy(&u,args,8); os << (int64_t) u; break;
+			case BLOG_UINT: memcpy(&u,args,8); os << u; break;
+			case BLOG_HEX: memcpy(&u,args,8); os << "0x" << std::hex << u << std::dec; break;
+			case BLOG_DOUBLE: memcpy(&d,args,8); os << d; break;
+			case BLOG_POINTER: memcpy(&u,args,8); os << (const void*)(uintptr_t) u; break;
+			case BLOG_CHAR: os << *args; break;
+			case BLOG_BOOL: os << (bool) *args; break;
+			case BLOG_STRING:
+				memcpy(&n,args,2);
+				if ((unsigned)(end - args) < 2u + n) return false;
+				os.write(args+2,n);
+				size += n;
+				break;
+			default: return false;
+		}
+		args += size;
+	}
+	return true;
+}
+
+// vim: ts=4 sw=4
@@ -0,0 +1,170 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under the terms of the GNU Affero Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// Binary logging: BLOG() is like LOG() but the record is not formatted.
+// Each record stores the LogSite, time, thread and the raw argument values into a memory-mapped segment file,
+// and the file, line, function and argument names of the site are written once per segment.
+// LogDecode turns segments back into the same text LOG() would have written.
+// If Log.Binary.File is not set, BLOG() formats the record and writes it like LOG().
+//
+// Use like this: BLOG(DEBUG) << "frame" << BLOGVAR(fn) << BLOGHEX(flags);
+// Only scalars, C strings and std::string can be logged; for anything else use LOG().
+
+#ifndef BINARYLOG_H
+#define BINARYLOG_H
+
+#include <stdint.h>
+#include <string>
+#include <ostream>
+
+#include "Logger.h"
+
+/**@name The binary log segment format.  All values are in host byte order. */
+//@{
+static const char sBinaryLogMagic[8] = { 'R','N','B','L','O','G','1',0 };
+
+/** At the start of every segment file. */
+struct BinaryLogHeader {
+	char mMagic[8];
+	uint32_t mPid;
+	uint32_t mSequence;			///< Segment number, starting at 1.
+	uint64_t mSize;				///< Size of the segment file.
+	volatile uint64_t mUsed;	///< Bytes allocated to entries so far, including this header.
+};
+
+/** Entry types. */
+enum BinaryLogEntryType {
+	BLOG_PENDING = 0,	///< Space claimed but the writer has not finished; mLength is written first.
+	BLOG_RECORD = 1,	///< A record: arguments follow.
+	BLOG_SITE = 2		///< A site description: line, file, function and the argument names follow.
+};
+
+/** Every entry starts with this; entries are 8 byte aligned. */
+struct BinaryLogEntry {
+	uint32_t mLength;			///< Bytes in the entry, including this header.
+	volatile uint16_t mType;	///< BinaryLogEntryType, written last.
+	uint16_t mPriority;
+	uint64_t mSite;				///< The address of the LogSite, which identifies it within the segment.
+	uint64_t mTime;				///< Microseconds since the epoch.
+	uint32_t mTid;
+	uint32_t mCount;			///< Number of arguments, or of argument names for BLOG_SITE.
+};
+
+/** Argument type tags.  Each argument is a tag byte followed by the value. */
+enum BinaryLogArgType {
+	BLOG_INT = 1,		///< int64_t
+	BLOG_UINT,			///< uint64_t
+	BLOG_HEX,			///< uint64_t, printed like LOGHEX.
+	BLOG_DOUBLE,		///< double
+	BLOG_POINTER,		///< uint64_t
+	BLOG_CHAR,			///< char
+	BLOG_BOOL,			///< char
+	BLOG_STRING			///< uint16_t length followed by the characters.
+};
+//@}
+
+/** A named argument, from BLOGVAR. */
+template <class T> struct BinaryLogField {
+	const char *mName;
+	const T &mValue;
+	BinaryLogField(const char *wName, const T &wValue) : mName(wName), mValue(wValue) { }
+};
+template <class T> BinaryLogField<T> blogField(const char *name, const T &value) { return BinaryLogField<T>(name,value); }
+
+/** A named argument printed in hex, from BLOGHEX. */
+struct BinaryLogHex {
+	const char *mName;
+	uint64_t mValue;
+	BinaryLogHex(const char *wName, uint64_t wValue) : mName(wName), mValue(wValue) { }
+};
+
+#define BLOGVAR(var) blogField(#var,var)
+#define BLOGVAR2(name,val) blogField(name,val)
+#define BLOGHEX(var) BinaryLogHex(#var,(uint64_t)(var))
+#define BLOGHEX2(name,val) BinaryLogHex(name,(uint64_t)(val))
+
+/**
+	A binary log record; like Log, the destructor does the work.
+	The arguments are packed into a fixed buffer on the stack; a record that does not fit is truncated.
+*/
+class BinaryLogRecord {
+	public:
+	static const unsigned sMaxArgs = 32;
+
+	private:
+	int mPriority;
+	LogSite *mSite;
+	unsigned mCount;
+	unsigned mLength;
+	const char *mNames[sMaxArgs];	///< The BLOGVAR names, or NULL.
+	const char *mPendingName;		///< Name for the next argument.
+	char mArgs[480];
+
+	bool reserve(unsigned needed);
+	void putValue(BinaryLogArgType type, const void *value, unsigned size);
+	void putString(const char *text, unsigned len);
+
+	public:
+	BinaryLogRecord(int wPriority, LogSite *wSite)
+		:mPriority(wPriority), mSite(wSite), mCount(0), mLength(0), mPendingName(0)
+	{ }
+	~BinaryLogRecord();
+
+	BinaryLogRecord& operator<<(bool val) { char c = val; putValue(BLOG_BOOL,&c,1); return *this; }
+	BinaryLogRecord& operator<<(char val) { putValue(BLOG_CHAR,&val,1); return *this; }
+	BinaryLogRecord& operator<<(int val) { return *this << (long long) val; }
+	BinaryLogRecord& operator<<(long val) { return *this << (long long) val; }
+	BinaryLogRecord& operator<<(long long val) { int64_t v = val; putValue(BLOG_INT,&v,8); return *this; }
+	BinaryLogRecord& operator<<(unsigned val) { return *this << (unsigned long long) val; }
+	BinaryLogRecord& operator<<(unsigned long val) { return *this << (unsigned long long) val; }
+	BinaryLogRecord& operator<<(unsigned long long val) { uint64_t v = val; putValue(BLOG_UINT,&v,8); return *this; }
+	BinaryLogRecord& operator<<(double val) { putValue(BLOG_DOUBLE,&val,8); return *this; }
+	BinaryLogRecord& operator<<(const void *val) { uint64_t v = (uintptr_t) val; putValue(BLOG_POINTER,&v,8); return *this; }
+	BinaryLogRecord& operator<<(const char *val);
+	BinaryLogRecord& operator<<(const std::string &val) { putString(val.data(),val.size()); return *this; }
+	BinaryLogRecord& operator<<(const BinaryLogHex &field) { mPendingName = field.mName; putValue(BLOG_HEX,&field.mValue,8); return *this; }
+	template <class T> BinaryLogRecord& operator<<(const BinaryLogField<T> &field) { mPendingName = field.mName; return *this << field.mValue; }
+};
+
+#define BLOG(wLevel) \
+	if (!RN_LOG_COMPILED(wLevel)) {} \
+	else if (LogSite *_rnSite = gLogSiteCheck(_LOG_SITE,LOG_##wLevel)) BinaryLogRecord(LOG_##wLevel,_rnSite)
+
+/** Open the first binary log segment if Log.Binary.File is set.  gLogInit calls this. */
+void gBinaryLogInit();
+/** Sync and close the current binary log segment; BLOG() goes back to writing text. */
+void gBinaryLogClose();
+/** Number of binary records lost because they did not fit in the segment that filled up or in the one after it. */
+unsigned long gBinaryLogDroppedCount();
+
+/**
+	Format the packed arguments of a record the way LOG() would have: BLOGVAR arguments as " name=value",
+	the rest as is.  names has one entry, possibly NULL, for each argument.
+	Returns false if the arguments are malformed.
+*/
+bool gBinaryLogFormat(std::ostream &os, const char *const *names, unsigned count, const char *args, unsigned len);
+
+#endif
+
+// vim: ts=4 sw=4
@@ -31,6 +31,12 @@
 #include <fstream>
 #include <iostream>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #ifdef DEBUG_CONFIG
 #define	debugLogEarly gLogEarly
@@ -52,10 +58,189 @@ static const char* createConfigTable = {
 	")"
 };
 
+// Changes to these keys must invalidate the per-call-site log level caches.
+static bool isLogKey(const string& key)
+{
+	return key.compare(0,4,"Log.") == 0;
+}
+
 // (pat) LOG() may not be initialized yet, so use syslog directly.
 #define LOGNOW(fmt,...) syslog(LOG_ERR, "ERR %s:" fmt,Utils::timestr().c_str(),__VA_ARGS__)
 
 
+/**@name Snapshot readers.
+	A thread pins the snapshot it is reading by storing it in its ConfigurationReader before checking that it is still current,
+	and a writer only frees a replaced snapshot that no reader has pinned: hazard pointers, in other words.
+	A reader has a few slots because a getter can end up in another getter, eg, through LOG() on a cache miss.
+	ConfigHandle cells are pinned the same way, in a slot of their own, while a ConfigHandle copies a value out of a cell.
+	The readers are never freed; the one of an exiting thread is cleared and reused by the next new thread.
+*/
+//@{
+struct ConfigurationReader {
+	ConfigurationReader *mNext;
+	volatile int mInUse;
+	unsigned mDepth;
+	static const unsigned sMaxDepth = 8;
+	ConfigurationSnapshot * volatile mHazard[sMaxDepth];
+	const void * volatile mCell;	///< the ConfigHandle cell being read, or NULL
+};
+
+static ConfigurationReader * volatile sConfigReaders = NULL;
+static __thread ConfigurationReader *tConfigReader = NULL;
+static pthread_key_t sConfigReaderKey;
+static pthread_once_t sConfigReaderKeyOnce = PTHREAD_ONCE_INIT;
+
+static void configReaderRelease(void *arg)
+{
+	ConfigurationReader *reader = (ConfigurationReader*)arg;
+	for (unsigned i = 0; i < ConfigurationReader::sMaxDepth; i++) { reader->mHazard[i] = NULL; }
+	reader->mCell = NULL;
+	__sync_synchronize();
+	reader->mInUse = 0;
+}
+
+static void configReaderKeyCreate() { pthread_key_create(&sConfigReaderKey,configReaderRelease); }
+
+static ConfigurationReader *configReader()
+{
+	if (tConfigReader) return tConfigReader;
+	ConfigurationReader *reader;
+	for (reader = sConfigReaders; reader; reader = reader->mNext) {
+		if (!reader->mInUse && __sync_bool_compare_and_swap(&reader->mInUse,0,1)) break;
+	}
+	if (reader == NULL) {
+		reader = (ConfigurationReader*) calloc(1,sizeof(ConfigurationReader));
+		assert(reader);
+		reader->mInUse = 1;
+		ConfigurationReader *head;
+		do {
+			head = sConfigReaders;
+			reader->mNext = head;
+		} while (!__sync_bool_compare_and_swap(&sConfigReaders,head,reader));
+	}
+	pthread_once(&sConfigReaderKeyOnce,configReaderKeyCreate);
+	pthread_setspecific(sConfigReaderKey,reader);
+	tConfigReader = reader;
+	return reader;
+}
+
+static bool configSnapshotPinned(const ConfigurationSnapshot *snap)
+{
+	for (ConfigurationReader *reader = sConfigReaders; reader; reader = reader->mNext) {
+		for (unsigned i = 0; i < ConfigurationReader::sMaxDepth; i++) {
+			if (reader->mHazard[i] == snap) return true;
+		}
+	}
+	return false;
+}
+
+void configHandlePin(const void *cell)
+{
+	configReader()->mCell = cell;
+	__sync_synchronize();
+}
+
+void configHandleUnpin()
+{
+	__sync_synchronize();
+	configReader()->mCell = NULL;
+}
+
+bool configHandlePinned(const void *cell)
+{
+	__sync_synchronize();
+	for (ConfigurationReader *reader = sConfigReaders; reader; reader = reader->mNext) {
+		if (reader->mCell == cell) return true;
+	}
+	return false;
+}
+
+/**
+	Holds one of the calling thread's hazard slots for as long as it exists.
+	A thread that is already sMaxDepth getters deep has no slot left, so it holds the table lock instead,
+	which keeps the current snapshot from being replaced.
+*/
+class ConfigurationReadGuard {
+	ConfigurationReader *mReader;
+	unsigned mSlot;
+	Mutex *mLock;		///< held instead of a slot, or NULL
+
+	public:
+	ConfigurationReadGuard(Mutex &tableLock) : mReader(configReader()), mSlot(mReader->mDepth++), mLock(NULL) {
+		if (mSlot >= ConfigurationReader::sMaxDepth) {
+			mLock = &tableLock;
+			mLock->lock();
+		}
+	}
+	~ConfigurationReadGuard() {
+		unpin();
+		mReader->mDepth--;
+		if (mLock) mLock->unlock();
+	}
+
+	/** Return the current snapshot, which stays valid until unpin() or the guard goes away. */
+	const ConfigurationSnapshot *pin(ConfigurationSnapshot * volatile &current) {
+		if (mLock) return current;
+		while (1) {
+			ConfigurationSnapshot *snap = current;
+			mReader->mHazard[mSlot] = snap;
+			__sync_synchronize();
+			if (snap == current) return snap;
+		}
+	}
+	void unpin() { if (!mLock) mReader->mHazard[mSlot] = NULL; }
+};
+
+ConfigurationSnapshot::ConfigurationSnapshot(const ConfigurationSnapshot &other)
+	:mRecords(other.mRecords), mMisses(NULL), mMissCount(0), mComplete(other.mComplete)
+{
+	for (const ConfigurationMiss *miss = other.mMisses; miss; miss = miss->mNext) {
+		mRecords[miss->mKey] = miss->mRecord;
+	}
+}
+
+ConfigurationSnapshot::~ConfigurationSnapshot()
+{
+	for (ConfigurationMiss *miss = mMisses; miss; ) {
+		ConfigurationMiss *next = miss->mNext;
+		delete miss;
+		miss = next;
+	}
+}
+
+const ConfigurationRecord *ConfigurationSnapshot::find(const std::string &key) const
+{
+	ConfigurationRecordTable::const_iterator where = mRecords.find(key);
+	if (where != mRecords.end()) return &where->second;
+	const ConfigurationMiss *miss = mMisses;
+	if (miss == NULL) return NULL;
+	uint64_t hash = HashString::hashOf(key.data(),key.size());
+	for (; miss; miss = miss->mNext) {
+		if (miss->mKey.hash() == hash && miss->mKey.compare(key) == 0) return &miss->mRecord;
+	}
+	return NULL;
+}
+
+void ConfigurationTable::publish(ConfigurationSnapshot *next)
+{
+	// mLock is held by caller
+	ConfigurationSnapshot *old = mSnapshot;
+	mSnapshot = next;
+	__sync_synchronize();
+	mRetired.push_back(old);
+	unsigned kept = 0;
+	for (unsigned i = 0; i < mRetired.size(); i++) {
+		if (configSnapshotPinned(mRetired[i])) {
+			mRetired[kept++] = mRetired[i];
+		} else {
+			delete mRetired[i];
+		}
+	}
+	mRetired.resize(kept);
+}
+//@}
+
+
 long ConfigurationRecord::number() const
 {
 	if (mValue.size() == 0 && ! mCRWarned) {
@@ -74,6 +259,70 @@ long ConfigurationRecord::number() const
 }
 
 
+ConfigurationRecord& ConfigurationRecord::operator=(const ConfigurationRecord &other)
+{
+	if (this != &other) {
+		if (other.mParsed) __sync_add_and_fetch(&other.mParsed->mRefs,1);
+		release();
+		mParsed = other.mParsed;
+		mCRKey = other.mCRKey;
+		mValue = other.mValue;
+		mDefined = other.mDefined;
+		mCRWarned = other.mCRWarned;
+	}
+	return *this;
+}
+
+
+ConfigurationRecord::~ConfigurationRecord()
+{
+	release();
+}
+
+
+const std::vector<unsigned>& ConfigurationRecord::numbers() const
+{
+	static const std::vector<unsigned> none;
+	if (mParsed == NULL) return none;
+	if (mParsed->mNumbers) return *mParsed->mNumbers;
+	std::vector<unsigned> *parsed = new std::vector<unsigned>;
+	char *line = strdup(mValue.c_str());
+	char *lp = line;
+	while (lp) {
+		// Watch for multiple or trailing spaces.
+		while (*lp==' ') lp++;
+		if (*lp=='\0') break;
+		parsed->push_back(strtol(lp,NULL,0));
+		strsep(&lp," ");
+	}
+	free(line);
+	// Another reader may have got there first.
+	if (!__sync_bool_compare_and_swap(&mParsed->mNumbers,(std::vector<unsigned>*)NULL,parsed)) { delete parsed; }
+	return *mParsed->mNumbers;
+}
+
+
+const std::vector<string>& ConfigurationRecord::strings() const
+{
+	static const std::vector<string> none;
+	if (mParsed == NULL) return none;
+	if (mParsed->mStrings) return *mParsed->mStrings;
+	std::vector<string> *parsed = new std::vector<string>;
+	char *line = strdup(mValue.c_str());
+	char *lp = line;
+	while (lp) {
+		while (*lp==' ') lp++;
+		if (*lp == '\0') break;
+		char *tp = strsep(&lp," ");
+		if (!tp) break;
+		parsed->push_back(tp);
+	}
+	free(line);
+	if (!__sync_bool_compare_and_swap(&mParsed->mStrings,(std::vector<string>*)NULL,parsed)) { delete parsed; }
+	return *mParsed->mStrings;
+}
+
+
 float ConfigurationRecord::floatNumber() const
 {
 	if (mValue.size() == 0 && ! mCRWarned) {
@@ -93,8 +342,34 @@ float ConfigurationRecord::floatNumber() const
 }
 
 
+static pthread_once_t sConfigForkOnce = PTHREAD_ONCE_INIT;
+static void configTableRegister(ConfigurationTable *table);
+static void configTableUnregister(ConfigurationTable *table);
+
 ConfigurationTable::ConfigurationTable(const char* filename, const char *wCmdName, ConfigurationKeyMap wSchema)
+	:mSnapshot(new ConfigurationSnapshot),
+	mGeneration(1),
+	mDataVersion(-1),
+	mLastPurge(0),
+	mChangedAll(false),
+	mNextSubscription(1),
+	mNotifier(NULL),
+	mNotifierStop(false),
+	mNotifySignal(NULL),
+	mCalling(0),
+	mHaveSubscribers(false),
+	mWatcher(NULL),
+	mWatcherForks(~0u),
+	mWatcherStop(false),
+	mSharedOwner(geteuid()),
+	mSharedFd(-1),
+	mShared(NULL),
+	mSharedSize(0),
+	mSharedPublisher(false),
+	mSharedDirty(false)
 {
+	pthread_once(&sConfigForkOnce,forkRegister);
+	configTableRegister(this);
 	gLogEarly(LOG_INFO, "opening configuration table from path %s", filename);
 	// Connect to the database.
 	int rc = sqlite3_open(filename,&mDB);
@@ -106,7 +381,7 @@ ConfigurationTable::ConfigurationTable(const char* filename, const char *wCmdNam
 	}
 	if (rc) {
 		gLogEarly(LOG_EMERG, "cannot open configuration database at %s, error message: %s", filename, sqlite3_errmsg(mDB));
-		sqlite3_close(mDB);
+		sqlite_close(mDB);
 		mDB = NULL;
 		return;
 	}
@@ -114,6 +389,15 @@ ConfigurationTable::ConfigurationTable(const char* filename, const char *wCmdNam
 	if (!sqlite3_command(mDB,createConfigTable)) {
 		gLogEarly(LOG_EMERG, "cannot create configuration table in database at %s, error message: %s", filename, sqlite3_errmsg(mDB));
 	}
+	mDataVersion = dataVersion();
+	// The shared segment is named for the database file, so that every process that opens the file finds it.
+	struct stat st;
+	if (stat(filename,&st) == 0) {
+		char path[80];
+		snprintf(path,sizeof(path),"/dev/shm/RNConfig.%lx.%lx",(unsigned long) st.st_dev,(unsigned long) st.st_ino);
+		mSharedPath = path;
+		mSharedOwner = st.st_uid;
+	}
 
 	// Pat and David both do not want to use WAL mode on the config databases.
 	// Set high-concurrency WAL mode.
@@ -145,6 +429,74 @@ ConfigurationTable::ConfigurationTable(const char* filename, const char *wCmdNam
 	mSchema[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("Log.Async","0",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::BOOLEAN,
+		"",
+		true,
+		"Hand log records to a dedicated writer thread instead of writing them to syslog, the console and Log.File on the calling thread."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Log.Async.Overflow","drop",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::CHOICE,
+		"drop|drop - discard the record and count it,"
+			"sync|sync - write the record on the calling thread",
+		true,
+		"What to do with a log record when the async log queue is full.  Alarms (CRIT and above) are never dropped."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Log.Async.QueueSize","4096",
+		"records",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"64:65536",
+		true,
+		"Number of records the async log queue can hold before Log.Async.Overflow applies."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Log.Binary.File","",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::FILEPATH_OPT,
+		"",
+		true,
+		"Write BLOG() records unformatted into memory-mapped segment files named by this path plus .1, .2, etc; decode them with LogDecode.  "
+			"By default, this feature is disabled and BLOG() records are written as text like LOG()."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Log.Binary.SegmentSize","16777216",
+		"bytes",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"65536:1073741824",
+		true,
+		"Size of each binary log segment file."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Log.Binary.Segments","4",
+		"files",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1:1000",
+		true,
+		"Number of binary log segment files to keep; older ones are deleted."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
 	tmp = new ConfigurationKey("Log.File","",
 		"",
 		ConfigurationKey::DEVELOPER,
@@ -159,6 +511,106 @@ ConfigurationTable::ConfigurationTable(const char* filename, const char *wCmdNam
 	mSchema[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("Log.File.FlushPeriod","1000",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:60000",
+		true,
+		"With Log.Async, how long a record may wait in memory before it is written to Log.File; 0 writes every batch as soon as it is formatted.  "
+			"Without Log.Async every record is written as it comes."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Log.File.Keep","4",
+		"files",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:1000",
+		true,
+		"Number of rotated Log.File files to keep, named Log.File.1 (the newest) and so on."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Log.File.MaxSize","104857600",
+		"bytes",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:2147483647",
+		true,
+		"Rotate Log.File when it reaches this size.  0 means no limit."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Log.File.RotatePeriod","0",
+		"seconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:31536000",
+		true,
+		"Rotate Log.File when it is this old.  0 means never."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Log.FlightRecorder","",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::CHOICE_OPT,
+		"EMERG|EMERGENCY,"
+			"ALERT|ALERT,"
+			"CRIT|CRITICAL,"
+			"ERR|ERROR,"
+			"WARNING|WARNING,"
+			"NOTICE|NOTICE,"
+			"INFO|INFORMATION,"
+			"DEBUG|DEBUG",
+		false,
+		"Keep the most recent log records of each thread down to this level in memory, even the ones below the logging level, "
+			"and write them to Log.FlightRecorder.File when the application crashes.  "
+			"By default, this feature is disabled."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Log.FlightRecorder.File","",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::FILEPATH_OPT,
+		"",
+		false,
+		"Where to write the flight recorder after a crash.  By default, /tmp/flightrecorder.<pid>."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Log.FlightRecorder.Records","256",
+		"records",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"16:65536",
+		true,
+		"Number of log records the flight recorder keeps for each thread."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Log.FoldRepeats","30",
+		"seconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"0:3600",
+		false,
+		"Identical consecutive log messages from the same line of code within this many seconds are counted instead of written, "
+			"and reported as \"last message repeated N times\".  "
+			"0 disables folding."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
 	tmp = new ConfigurationKey("Log.Level","NOTICE",
 		"",
 		ConfigurationKey::CUSTOMER,
@@ -177,34 +629,61 @@ ConfigurationTable::ConfigurationTable(const char* filename, const char *wCmdNam
 	mSchema[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("Log.Syslog.Direct","0",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::BOOLEAN,
+		"",
+		true,
+		"Send log records to Log.Syslog.Path directly, in batches, instead of through the C library syslog().  "
+			"Records that syslogd cannot accept right away are dropped and counted instead of holding up the application."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Log.Syslog.Path","/dev/log",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::FILEPATH,
+		"",
+		true,
+		"The syslogd socket used by Log.Syslog.Direct."
+	);
+	mSchema[tmp->getName()] = *tmp;
+	delete tmp;
+
 	// Add application specific schema
 	mSchema.insert(wSchema.begin(), wSchema.end());
 
 	// Init the cross checking callback to something predictable
 	mCrossCheck = NULL;
 
+	// Load everything now, so startup costs one query instead of one per key.
+	{
+		ScopedLock lock(mLock);
+		publish(preload());
+	}
+
 #define DUMP_CONFIGURATION_TABLE 1
 #if DUMP_CONFIGURATION_TABLE
 	// (pat) Dump any non-default config variables...
-	try {
-		if (wCmdName == NULL) { wCmdName = ""; }
-		LOG(INFO) << wCmdName << ":" << " List of non-default config parameters:";
-		string snippet("");
-		ConfigurationKeyMap view = getSimilarKeys(snippet);
-		for (ConfigurationKeyMap::iterator it = view.begin(); it != view.end(); it++) {
-			string name = it->first;
-			ConfigurationKey key = it->second;
-			if (name != key.getName()) {
-				LOG(ALERT) << "SQL database is corrupt at name:"<<name <<" !=  key:"<<key.getName();
-			}
-			string defaultValue= key.getDefaultValue();
-			string value = this->getStr(name);
-			if (value != defaultValue) {
-				LOG(INFO) << "Config Variable"<<LOGVAR(name) <<LOGVAR(value) <<LOGVAR(defaultValue);
-			}
+	// This works from the preloaded snapshot; nothing else can have seen the table yet, so it needs no guard.
+	if (wCmdName == NULL) { wCmdName = ""; }
+	LOG(INFO) << wCmdName << ":" << " List of non-default config parameters:";
+	const ConfigurationRecordTable &records = mSnapshot->mRecords;
+	for (ConfigurationKeyMap::const_iterator it = mSchema.begin(); it != mSchema.end(); it++) {
+		const string &name = it->first;
+		const ConfigurationKey &key = it->second;
+		if (name != key.getName()) {
+			LOG(ALERT) << "SQL database is corrupt at name:"<<name <<" !=  key:"<<key.getName();
+		}
+		ConfigurationRecordTable::const_iterator where = records.find(name);
+		if (where == records.end() || !where->second.defined()) continue;
+		const string &defaultValue = key.getDefaultValue();
+		const string &value = where->second.value();
+		if (value != defaultValue) {
+			LOG(INFO) << "Config Variable"<<LOGVAR(name) <<LOGVAR(value) <<LOGVAR(defaultValue);
 		}
-	} catch (...) {
-		LOG(INFO) << wCmdName << ":" << " EXCEPTION CAUGHT";
 	}
 #endif
 
@@ -344,8 +823,8 @@ string ConfigurationTable::getTeX(const std::string& program, const std::string&
 bool ConfigurationTable::defines(const string& key)
 {
 	try {
-		ScopedLock lock(mLock);
-		return lookup(key).defined();
+		ConfigurationReadGuard guard(mLock);
+		return lookup(key,guard).defined();
 	} catch (ConfigurationTableKeyNotFound) {
 		// TODO: re-enable once we figure out why this message is being sent to syslog regardless of log level
 		//gLogEarly(LOG_DEBUG, "configuration parameter %s not found", key.c_str());
@@ -358,12 +837,123 @@ bool ConfigurationTable::keyDefinedInSchema(const std::string& name)
 	return mSchema.find(name) == mSchema.end() ? false : true;
 }
 
-bool ConfigurationTable::isValidValue(const std::string& name, const std::string& val) {
-	bool ret = false;
+/**@name Compiled validators.
+	isValidValue used to pick the valid values of a key apart, and compile its regular expressions, on every call.
+	Now the first check of a key compiles them into a ConfigurationValidator, which is kept until the type or valid values
+	of the key change, which the application is allowed to do through mSchema.
+*/
+//@{
+// The characters the old "^[...]+$" expressions allowed.
+static const char *sFilePathChars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789/_.-";
+static const char *sHostNameChars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.-";
+static const char *sIntegerChars = "0123456789-";
+static const char *sFloatChars = "0123456789.-";
+
+/** Return true if val is not empty and has only characters from chars. */
+static bool allOf(const std::string& val, const char *chars)
+{
+	return val.size() && strspn(val.c_str(),chars) == val.size();
+}
+
+/** Read an int the way stringstream >> int does: no digits, or too many, is a failure.  Return false on failure. */
+static bool readInt(const char *str, int &result)
+{
+	char *end;
+	long value = strtol(str,&end,10);
+	if (end == str || value != (int) value) return false;
+	result = value;
+	return true;
+}
+
+class ConfigurationValidator {
+
+	public:
+
+	ConfigurationKey::Type mType;
+	std::string mValidValues;		///< What this was compiled from.
+
+	private:
 
-	ConfigurationKey key = mSchema[name];
+	HashStringTable<bool> mChoices;	///< For CHOICE.
+	bool mRangeIsFloat;				///< For VALRANGE: the range has a decimal point.
+	float mMin, mMax;				///< For VALRANGE with a decimal point.
+	long mIntMin, mIntMax;			///< For VALRANGE without.
+	regex_t mRegex;					///< For STRING.
+	bool mRegexOk;
 
-	switch (key.getType()) {
+	public:
+
+	ConfigurationValidator(const ConfigurationKey &key);
+	~ConfigurationValidator() { if (mRegexOk) regfree(&mRegex); }
+
+	bool check(const std::string& val) const;
+
+	private:
+
+	// Not copyable because of mRegex.
+	ConfigurationValidator(const ConfigurationValidator&);
+	ConfigurationValidator& operator=(const ConfigurationValidator&);
+};
+
+ConfigurationValidator::ConfigurationValidator(const ConfigurationKey &key)
+	:mType(key.getType()), mValidValues(key.getValidValues()),
+	mRangeIsFloat(false), mMin(0), mMax(0), mIntMin(0), mIntMax(0), mRegexOk(false)
+{
+	switch (mType) {
+		case ConfigurationKey::CHOICE_OPT:
+		case ConfigurationKey::CHOICE: {
+			// The same walk through "value|description,value|description,..." that isValidValue used to do per check.
+			int startPos = -1;
+			size_t endPos = 0;
+			const std::string &tmp = mValidValues;
+			do {
+				startPos++;
+				if ((endPos = tmp.find('|', startPos)) != std::string::npos) {
+					mChoices[tmp.substr(startPos, endPos-startPos)] = true;
+				} else {
+					mChoices[tmp.substr(startPos, tmp.find(',', startPos)-startPos)] = true;
+				}
+			} while ((startPos = tmp.find(',', startPos)) != (int)std::string::npos);
+			break;
+		}
+		case ConfigurationKey::STRING_OPT:
+		case ConfigurationKey::STRING: {
+			int result = regcomp(&mRegex, mValidValues.c_str(), REG_EXTENDED);
+			if (result) {
+				char msg[256];
+				regerror(result,&mRegex,msg,255);
+				LOGNOW("configuration key '%s' has a bad regular expression: %s", key.getName().c_str(), msg);
+			} else {
+				mRegexOk = true;
+			}
+			break;
+		}
+		case ConfigurationKey::VALRANGE: {
+			std::string strMin, strMax, strSteps;
+			ConfigurationKey::getMinMaxStepping(key, strMin, strMax, strSteps);
+			mRangeIsFloat = mValidValues.find('.') != std::string::npos;
+			if (mRangeIsFloat) {
+				std::stringstream(strMin) >> mMin;
+				std::stringstream(strMax) >> mMax;
+			} else {
+				int min = 0, max = 0;
+				std::stringstream(strMin) >> min;
+				std::stringstream(strMax) >> max;
+				mIntMin = min;
+				mIntMax = max;
+			}
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+bool ConfigurationValidator::check(const std::string& val) const
+{
+	bool ret = false;
+
+	switch (mType) {
 		case ConfigurationKey::BOOLEAN: {
 			if (val == "1" || val == "0") {
 				ret = true;
@@ -378,26 +968,7 @@ bool ConfigurationTable::isValidValue(const std::string& name, const std::string
 			}
 		}
 		case ConfigurationKey::CHOICE: {
-			int startPos = -1;
-			uint endPos = 0;
-
-			std::string tmp = key.getValidValues();
-
-			do {
-				startPos++;
-				if ((endPos = tmp.find('|', startPos)) != std::string::npos) {
-					if (val == tmp.substr(startPos, endPos-startPos)) {
-						ret = true;
-						break;
-					}
-				} else {
-					if (val == tmp.substr(startPos, tmp.find(',', startPos)-startPos)) {
-						ret = true;
-						break;
-					}
-				}
-
-			} while ((startPos = tmp.find(',', startPos)) != (int)std::string::npos);
+			ret = mChoices.find(val) != mChoices.end();
 			break;
 		}
 
@@ -408,15 +979,13 @@ bool ConfigurationTable::isValidValue(const std::string& name, const std::string
 			}
 		}
 		case ConfigurationKey::CIDR: {
-			uint delimiter;
-			std::string ip;
+			size_t delimiter;
 			int cidr = -1;
 
 			delimiter = val.find('/');
 			if (delimiter != std::string::npos) {
-				ip = val.substr(0, delimiter);
-				std::stringstream(val.substr(delimiter+1)) >> cidr;
-				if (ConfigurationKey::isValidIP(ip) && 0 <= cidr && cidr <= 32) {
+				if (readInt(val.c_str()+delimiter+1,cidr) && 0 <= cidr && cidr <= 32 &&
+					ConfigurationKey::isValidIP(val.substr(0, delimiter))) {
 					ret = true;
 				}
 			}
@@ -430,18 +999,7 @@ bool ConfigurationTable::isValidValue(const std::string& name, const std::string
 			}
 		}
 		case ConfigurationKey::FILEPATH: {
-			regex_t r;
-			const char* expression = "^[a-zA-Z0-9/_.-]+$";
-			int result = regcomp(&r, expression, REG_EXTENDED);
-			if (result) {
-				char msg[256];
-				regerror(result,&r,msg,255);
-				break;//abort();
-			}
-			if (regexec(&r, val.c_str(), 0, NULL, 0)==0) {
-				ret = true;
-			}
-			regfree(&r);
+			ret = allOf(val,sFilePathChars);
 			break;
 		}
 
@@ -452,33 +1010,14 @@ bool ConfigurationTable::isValidValue(const std::string& name, const std::string
 			}
 		}
 		case ConfigurationKey::HOSTANDPORT: {
-			uint delimiter;
-			std::string host;
+			size_t delimiter;
 			int port = -1;
-			bool validHost = false;
 
 			delimiter = val.find(':');
 			if (delimiter != std::string::npos) {
-				host = val.substr(0, delimiter);
-				std::stringstream(val.substr(delimiter+1)) >> port;
-				if (ConfigurationKey::isValidIP(host)) {
-					validHost = true;
-				} else {
-					regex_t r;
-					const char* expression = "^[a-zA-Z0-9_.-]+$";
-					int result = regcomp(&r, expression, REG_EXTENDED);
-					if (result) {
-						char msg[256];
-						regerror(result,&r,msg,255);
-						break;//abort();
-					}
-					if (regexec(&r, host.c_str(), 0, NULL, 0)==0) {
-						validHost = true;
-					}
-					regfree(&r);
-				}
-
-				if (validHost && 1 <= port && port <= 65535) {
+				std::string host = val.substr(0, delimiter);
+				if (readInt(val.c_str()+delimiter+1,port) && 1 <= port && port <= 65535 &&
+					(allOf(host,sHostNameChars) || ConfigurationKey::isValidIP(host))) {
 					ret = true;
 				}
 			}
@@ -497,15 +1036,13 @@ bool ConfigurationTable::isValidValue(const std::string& name, const std::string
 		}
 
 		case ConfigurationKey::IPANDPORT: {
-			uint delimiter;
-			std::string ip;
+			size_t delimiter;
 			int port = -1;
 
 			delimiter = val.find(':');
 			if (delimiter != std::string::npos) {
-				ip = val.substr(0, delimiter);
-				std::stringstream(val.substr(delimiter+1)) >> port;
-				if (ConfigurationKey::isValidIP(ip) && 1 <= port && port <= 65535) {
+				if (readInt(val.c_str()+delimiter+1,port) && 1 <= port && port <= 65535 &&
+					ConfigurationKey::isValidIP(val.substr(0, delimiter))) {
 					ret = true;
 				}
 			}
@@ -520,8 +1057,8 @@ bool ConfigurationTable::isValidValue(const std::string& name, const std::string
 		}
 		case ConfigurationKey::MIPADDRESS: {
 			int startPos = -1;
-			uint endPos = 0;
-			uint delimiter;
+			size_t endPos = 0;
+			size_t delimiter;
 			std::string ip;
 			int port = -1;
 
@@ -562,9 +1099,7 @@ bool ConfigurationTable::isValidValue(const std::string& name, const std::string
 		case ConfigurationKey::PORT: {
 			int intVal;
 
-			std::stringstream(val) >> intVal;
-
-			if (1 <= intVal && intVal <= 65535) {
+			if (readInt(val.c_str(),intVal) && 1 <= intVal && intVal <= 65535) {
 				ret = true;
 			}
 			break;
@@ -577,6 +1112,7 @@ bool ConfigurationTable::isValidValue(const std::string& name, const std::string
 			}
 		}
 		case ConfigurationKey::REGEX: {
+			// The value is the expression, so there is nothing to compile ahead of time.
 			regex_t r;
 			const char* expression = val.c_str();
 			int result = regcomp(&r, expression, REG_EXTENDED);
@@ -585,8 +1121,8 @@ bool ConfigurationTable::isValidValue(const std::string& name, const std::string
 				regerror(result,&r,msg,255);
 			} else {
 				ret = true;
+				regfree(&r);
 			}
-			regfree(&r);
 			break;
 		}
 
@@ -597,49 +1133,45 @@ bool ConfigurationTable::isValidValue(const std::string& name, const std::string
 			}
 		}
 		case ConfigurationKey::STRING: {
-			regex_t r;
-			const char* expression = key.getValidValues().c_str();
-			int result = regcomp(&r, expression, REG_EXTENDED);
-			if (result) {
-				char msg[256];
-				regerror(result,&r,msg,255);
-				break;//abort();
-			}
-			if (regexec(&r, val.c_str(), 0, NULL, 0)==0) {
+			if (mRegexOk && regexec(&mRegex, val.c_str(), 0, NULL, 0)==0) {
 				ret = true;
 			}
-			regfree(&r);
 			break;
 		}
 
 		case ConfigurationKey::VALRANGE: {
-			regex_t r;
-			int result;
-			if (key.getValidValues().find('.') != std::string::npos) {
-				result = regcomp(&r, "^[0-9.-]+$", REG_EXTENDED);
-			} else {
-				result = regcomp(&r, "^[0-9-]+$", REG_EXTENDED);
-			}
-			if (result) {
-				char msg[256];
-				regerror(result,&r,msg,255);
-				break;//abort();
-			}
-			if (regexec(&r, val.c_str(), 0, NULL, 0)!=0) {
-				ret = false;
-			} else if (key.getValidValues().find('.') != std::string::npos) {
-				ret = ConfigurationKey::isInValRange<float>(key, val, false);
-			} else {
-				ret = ConfigurationKey::isInValRange<int>(key, val, true);
+			// TODO : only ranges checked, steps not enforced
+			if (mRangeIsFloat) {
+				if (allOf(val,sFloatChars)) {
+					float convVal = strtof(val.c_str(),NULL);
+					ret = mMin <= convVal && convVal <= mMax;
+				}
+			} else if (allOf(val,sIntegerChars)) {
+				long convVal = strtol(val.c_str(),NULL,10);
+				ret = mIntMin <= convVal && convVal <= mIntMax;
 			}
-
-			regfree(&r);
 			break;
 		}
 	}
 
 	return ret;
 }
+//@}
+
+bool ConfigurationTable::isValidValue(const std::string& name, const std::string& val) {
+	ConfigurationKeyMap::const_iterator where = mSchema.find(name);
+	if (where == mSchema.end()) return false;
+	const ConfigurationKey &key = where->second;
+
+	ScopedLock lock(mValidatorLock);
+	ConfigurationValidator *&validator = mValidators[name];
+	if (validator && (validator->mType != key.getType() || validator->mValidValues != key.getValidValues())) {
+		delete validator;
+		validator = NULL;
+	}
+	if (validator == NULL) { validator = new ConfigurationValidator(key); }
+	return validator->check(val);
+}
 
 ConfigurationKeyMap ConfigurationTable::getSimilarKeys(const std::string& snippet) {
 	ConfigurationKeyMap tmp;
@@ -655,45 +1187,73 @@ ConfigurationKeyMap ConfigurationTable::getSimilarKeys(const std::string& snippe
 	return tmp;
 }
 
-const ConfigurationRecord& ConfigurationTable::lookup(const string& key)
+const ConfigurationRecord& ConfigurationTable::lookup(const string& key, ConfigurationReadGuard &guard)
 {
 	assert(mDB);
 	checkCacheAge();
-	// We assume the caller holds mLock.
-	// So it is OK to return a reference into the cache.
-
-	// Check the cache.
-	// This is cheap.
-	ConfigurationMap::const_iterator where = mCache.find(key);
-	if (where!=mCache.end()) {
-		if (where->second.defined()) return where->second;
-		throw ConfigurationTableKeyNotFound(key);
+
+	while (1) {
+		// Check the cache.
+		// This is cheap.
+		// It is OK to return a reference into the snapshot because the guard keeps it alive.
+		const ConfigurationSnapshot *snap = guard.pin(mSnapshot);
+		const ConfigurationRecord *rec = snap->find(key);
+		if (rec) {
+			if (rec->defined()) return *rec;
+			throw ConfigurationTableKeyNotFound(key);
+		}
+		// Let go of the snapshot while we go to the database, since a new one is about to replace it.
+		guard.unpin();
+		cacheMiss(key);
 	}
+}
+
+// The most keys cacheMiss adds to a snapshot before it copies it; a lookup that is not in mRecords looks through this many.
+static const unsigned sMaxMisses = 32;
+
+void ConfigurationTable::cacheMiss(const string& key)
+{
+	ScopedLock lock(mLock);
+	// Another thread may have read it while we waited for the lock.
+	if (mSnapshot->find(key)) return;
 
 	// Check the database.
 	// This is more expensive.
+	// A complete snapshot already has every row, so the key can only be a schema default added since it was loaded.
 	char *value = NULL;
-	sqlite3_single_lookup(mDB,"CONFIG",
-			"KEYSTRING",key.c_str(),"VALUESTRING",value);
+	if (!mSnapshot->mComplete) {
+		sqlite3_single_lookup(mDB,"CONFIG",
+				"KEYSTRING",key.c_str(),"VALUESTRING",value);
+	}
 
 	// (pat 9-2014) If sqlite3_single_lookup returns false, the behavior below is incorrect.
 
+	ConfigurationRecord record;
 	// value found, cache the result
 	if (value) {
-		mCache[key] = ConfigurationRecord(key,value);
+		record = ConfigurationRecord(key,value);
+		free(value);
 	// key definition found, cache the default
 	} else if (keyDefinedInSchema(key)) {
-		mCache[key] = ConfigurationRecord(key,mSchema[key].getDefaultValue());
+		record = ConfigurationRecord(key,mSchema[key].getDefaultValue());
 	// total miss, cache the error
 	} else {
-		mCache[key] = ConfigurationRecord(key,false);
-		throw ConfigurationTableKeyNotFound(key);
+		record = ConfigurationRecord(key,false);
 	}
 
-	if (value) free(value);
-
-	// Leave mLock locked.  The caller holds it still.
-	return mCache[key];
+	// Add it to the misses of the current snapshot, which costs nothing like a copy of the snapshot,
+	// until there are enough of them to be worth folding into a new one.
+	ConfigurationSnapshot *snap = mSnapshot;
+	if (snap->mMissCount < sMaxMisses) {
+		ConfigurationMiss *miss = new ConfigurationMiss(key,record,snap->mMisses);
+		__sync_synchronize();
+		snap->mMisses = miss;
+		snap->mMissCount++;
+	} else {
+		ConfigurationSnapshot *next = new ConfigurationSnapshot(*snap);
+		next->mRecords[key] = record;
+		publish(next);
+	}
 }
 
 
@@ -714,8 +1274,8 @@ string ConfigurationTable::getStr(const string& key)
 {
 	// We need the lock because rec is a reference into the cache.
 	try {
-		ScopedLock lock(mLock);
-		return lookup(key).value();
+		ConfigurationReadGuard guard(mLock);
+		return lookup(key,guard).value();
 	} catch (ConfigurationTableKeyNotFound) {
 		// Raise an alert and re-throw the exception.
 		gLogEarly(LOG_DEBUG, "configuration parameter %s has no defined value", key.c_str());
@@ -740,8 +1300,8 @@ long ConfigurationTable::getNum(const string& key)
 {
 	// We need the lock because rec is a reference into the cache.
 	try {
-		ScopedLock lock(mLock);
-		return lookup(key).number();
+		ConfigurationReadGuard guard(mLock);
+		return lookup(key,guard).number();
 	} catch (ConfigurationTableKeyNotFound) {
 		// Raise an alert and re-throw the exception.
 		gLogEarly(LOG_DEBUG, "configuration parameter %s has no defined value", key.c_str());
@@ -753,8 +1313,8 @@ long ConfigurationTable::getNum(const string& key)
 float ConfigurationTable::getFloat(const string& key)
 {
 	try {
-		ScopedLock lock(mLock);
-		return lookup(key).floatNumber();
+		ConfigurationReadGuard guard(mLock);
+		return lookup(key,guard).floatNumber();
 	} catch (ConfigurationTableKeyNotFound) {
 		// Raise an alert and re-throw the exception.
 		gLogEarly(LOG_DEBUG, "configuration parameter %s has no defined value", key.c_str());
@@ -764,63 +1324,41 @@ float ConfigurationTable::getFloat(const string& key)
 
 std::vector<string> ConfigurationTable::getVectorOfStrings(const string& key)
 {
-	// Look up the string.
-	char *line=NULL;
+	// The copy is made before the guard lets go of the snapshot.
 	try {
-		ScopedLock lock(mLock);
-		const ConfigurationRecord& rec = lookup(key);
-		line = strdup(rec.value().c_str());
+		ConfigurationReadGuard guard(mLock);
+		return lookup(key,guard).strings();
 	} catch (ConfigurationTableKeyNotFound) {
 		// Raise an alert and re-throw the exception.
 		gLogEarly(LOG_DEBUG, "configuration parameter %s has no defined value", key.c_str());
 		throw ConfigurationTableKeyNotFound(key);
 	}
-
-	assert(line);
-	char *lp = line;
-	
-	// Parse the string.
-	std::vector<string> retVal;
-	while (lp) {
-		while (*lp==' ') lp++;
-		if (*lp == '\0') break;
-		char *tp = strsep(&lp," ");
-		if (!tp) break;
-		retVal.push_back(tp);
-	}
-	free(line);
-	return retVal;
 }
 
 
 std::vector<unsigned> ConfigurationTable::getVector(const string& key)
 {
-	// Look up the string.
-	char *line=NULL;
 	try {
-		ScopedLock lock(mLock);
-		const ConfigurationRecord& rec = lookup(key);
-		line = strdup(rec.value().c_str());
+		ConfigurationReadGuard guard(mLock);
+		return lookup(key,guard).numbers();
 	} catch (ConfigurationTableKeyNotFound) {
 		// Raise an alert and re-throw the exception.
 		gLogEarly(LOG_DEBUG, "configuration parameter %s has no defined value", key.c_str());
 		throw ConfigurationTableKeyNotFound(key);
 	}
+}
 
-	assert(line);
-	char *lp = line;
 
-	// Parse the string.
-	std::vector<unsigned> retVal;
-	while (lp) {
-		// Watch for multiple or trailing spaces.
-		while (*lp==' ') lp++;
-		if (*lp=='\0') break;
-		retVal.push_back(strtol(lp,NULL,0));
-		strsep(&lp," ");
+unsigned ConfigurationTable::getVectorLength(const string& key)
+{
+	try {
+		ConfigurationReadGuard guard(mLock);
+		return lookup(key,guard).numbers().size();
+	} catch (ConfigurationTableKeyNotFound) {
+		// Raise an alert and re-throw the exception.
+		gLogEarly(LOG_DEBUG, "configuration parameter %s has no defined value", key.c_str());
+		throw ConfigurationTableKeyNotFound(key);
 	}
-	free(line);
-	return retVal;
 }
 
 
@@ -829,12 +1367,24 @@ bool ConfigurationTable::remove(const string& key)
 	assert(mDB);
 
 	ScopedLock lock(mLock);
-	// Clear the cache entry and the database.
-	ConfigurationMap::iterator where = mCache.find(key);
-	if (where!=mCache.end()) mCache.erase(where);
-	// Really remove it.
-	string cmd = "DELETE FROM CONFIG WHERE KEYSTRING=='"+key+"'";
-	return sqlite3_command(mDB,cmd.c_str());
+	// Remove it from the database, then from the cache, as set() does.
+	sqlStatement stmt(mDB,"DELETE FROM CONFIG WHERE KEYSTRING==?");
+	bool success = stmt.ok() && stmt.bindText(1,key) && stmt.step() == SQLITE_DONE;
+	if (success) {
+		ConfigurationSnapshot *next = new ConfigurationSnapshot(*mSnapshot);
+		ConfigurationRecordTable::iterator where = next->mRecords.find(key);
+		if (where!=next->mRecords.end()) next->mRecords.erase(where);
+		// A complete snapshot has to keep the default, since a missing key there means not defined.
+		if (next->mComplete && keyDefinedInSchema(key)) {
+			next->mRecords[key] = ConfigurationRecord(key,mSchema[key].getDefaultValue());
+		}
+		publish(next);
+		changed();
+		notify(key);
+		if (isLogKey(key)) gLogConfigChanged();
+		sharedChanged();
+	}
+	return success;
 }
 
 
@@ -842,11 +1392,12 @@ bool ConfigurationTable::remove(const string& key)
 void ConfigurationTable::find(const string& pat, ostream& os) const
 {
 	// Prepare the statement.
-	string cmd = "SELECT KEYSTRING,VALUESTRING FROM CONFIG WHERE KEYSTRING LIKE \"%" + pat + "%\"";
-	sqlite3_stmt *stmt;
-	if (sqlite3_prepare_statement(mDB,&stmt,cmd.c_str())) return;
+	sqlStatement query(mDB,"SELECT KEYSTRING,VALUESTRING FROM CONFIG WHERE KEYSTRING LIKE ?");
+	if (!query.ok()) return;
+	query.bindText(1,"%" + pat + "%");
+	sqlite3_stmt *stmt = query.stmt();
 	// Read the result.
-	int src = sqlite3_run_query(mDB,stmt);
+	int src = query.step();
 	while (src==SQLITE_ROW) {
 		const char* value = (const char*)sqlite3_column_text(stmt,1);
 		os << sqlite3_column_text(stmt,0) << " ";
@@ -856,9 +1407,8 @@ void ConfigurationTable::find(const string& pat, ostream& os) const
 		}
 		if (len && value) os << value << endl;
 		else os << "(disabled)" << endl;
-		src = sqlite3_run_query(mDB,stmt);
+		src = query.step();
 	}
-	sqlite3_finalize(stmt);
 }
 
 
@@ -867,11 +1417,11 @@ ConfigurationRecordMap ConfigurationTable::getAllPairs() const
 	ConfigurationRecordMap tmp;
 
 	// Prepare the statement.
-	string cmd = "SELECT KEYSTRING,VALUESTRING FROM CONFIG";
-	sqlite3_stmt *stmt;
-	if (sqlite3_prepare_statement(mDB,&stmt,cmd.c_str())) return tmp;
+	sqlStatement query(mDB,"SELECT KEYSTRING,VALUESTRING FROM CONFIG");
+	if (!query.ok()) return tmp;
+	sqlite3_stmt *stmt = query.stmt();
 	// Read the result.
-	int src = sqlite3_run_query(mDB,stmt);
+	int src = query.step();
 	while (src==SQLITE_ROW) {
 		const char* key = (const char*)sqlite3_column_text(stmt,0);
 		const char* value = (const char*)sqlite3_column_text(stmt,1);
@@ -882,27 +1432,38 @@ ConfigurationRecordMap ConfigurationTable::getAllPairs() const
 			string skey(key);
 			tmp[skey] = ConfigurationRecord(skey,false);
 		}
-		src = sqlite3_run_query(mDB,stmt);
+		src = query.step();
 	}
-	sqlite3_finalize(stmt);
 
 	return tmp;
 }
 
+bool ConfigurationTable::writeValue(const string& key, const string& value)
+{
+	// mLock is held by caller
+	bool inSchema = keyDefinedInSchema(key);
+	sqlStatement stmt(mDB,inSchema ?
+		"INSERT OR REPLACE INTO CONFIG (KEYSTRING,VALUESTRING,OPTIONAL,COMMENTS) VALUES (?,?,1,?)" :
+		"INSERT OR REPLACE INTO CONFIG (KEYSTRING,VALUESTRING,OPTIONAL) VALUES (?,?,1)");
+	return stmt.ok() && stmt.bindText(1,key) && stmt.bindText(2,value) &&
+		(!inSchema || stmt.bindText(3,mSchema[key].getDescription())) && stmt.step() == SQLITE_DONE;
+}
+
 bool ConfigurationTable::set(const string& key, const string& value)
 {
 	assert(mDB);
 	ScopedLock lock(mLock);
-	string cmd;
-	if (keyDefinedInSchema(key)) {
-		cmd = "INSERT OR REPLACE INTO CONFIG (KEYSTRING,VALUESTRING,OPTIONAL,COMMENTS) VALUES (\"" + key + "\",\"" + value + "\",1,\'" + mSchema[key].getDescription() + "\')";
-	} else {
-		cmd = "INSERT OR REPLACE INTO CONFIG (KEYSTRING,VALUESTRING,OPTIONAL) VALUES (\"" + key + "\",\"" + value + "\",1)";
-	}
-	
-	bool success = sqlite3_command(mDB,cmd.c_str());
+	bool success = writeValue(key,value);
 	// Cache the result.
-	if (success) mCache[key] = ConfigurationRecord(key,value);
+	if (success) {
+		ConfigurationSnapshot *next = new ConfigurationSnapshot(*mSnapshot);
+		next->mRecords[key] = ConfigurationRecord(key,value);
+		publish(next);
+		changed();
+		notify(key);
+		sharedChanged();
+	}
+	if (isLogKey(key)) gLogConfigChanged();
 	return success;
 }
 
@@ -913,35 +1474,626 @@ bool ConfigurationTable::set(const string& key, long value)
 	return set(key,buffer);
 }
 
-void ConfigurationTable::checkCacheAge()
+bool ConfigurationTable::setMany(const std::map<string,string>& values, vector<string> *invalidKeys)
+{
+	assert(mDB);
+	typedef std::map<string,string>::const_iterator Iter;
+	bool valid = true;
+	for (Iter it = values.begin(); it != values.end(); it++) {
+		if (keyDefinedInSchema(it->first) && !isValidValue(it->first,it->second)) {
+			gLogEarly(LOG_WARNING, "configuration parameter %s: invalid value '%s'", it->first.c_str(), it->second.c_str());
+			if (invalidKeys) invalidKeys->push_back(it->first);
+			valid = false;
+		}
+	}
+	if (!valid) return false;
+
+	ScopedLock lock(mLock);
+	// One transaction, so one sync for the lot.
+	if (!sqlite3_command(mDB,"BEGIN IMMEDIATE")) {
+		gLogEarly(LOG_ERR, "cannot start configuration update, error message: %s", sqlite3_errmsg(mDB));
+		return false;
+	}
+	bool success = true;
+	for (Iter it = values.begin(); success && it != values.end(); it++) {
+		success = writeValue(it->first,it->second);
+	}
+	if (success) success = sqlite3_command(mDB,"COMMIT");
+	if (!success) {
+		gLogEarly(LOG_ERR, "cannot write configuration update, error message: %s", sqlite3_errmsg(mDB));
+		sqlite3_command(mDB,"ROLLBACK");
+		return false;
+	}
+
+	// Cache the results, all in one snapshot.
+	ConfigurationSnapshot *next = new ConfigurationSnapshot(*mSnapshot);
+	bool logKeys = false;
+	for (Iter it = values.begin(); it != values.end(); it++) {
+		next->mRecords[it->first] = ConfigurationRecord(it->first,it->second);
+		if (isLogKey(it->first)) logKeys = true;
+	}
+	publish(next);
+	changed();
+	for (Iter it = values.begin(); it != values.end(); it++) { notify(it->first); }
+	if (logKeys) gLogConfigChanged();
+	sharedChanged();
+	return true;
+}
+
+ConfigurationSnapshot *ConfigurationTable::preload()
+{
+	// mLock is held by caller, or we are in the constructor.
+	ConfigurationSnapshot *snap = new ConfigurationSnapshot;
+	if (mDB == NULL) return snap;
+	// Another process may have published the table, in which case there is no need to ask sqlite.
+	bool loaded = false;
+	if (!mSharedPublisher) {
+		sharedOpen();
+		if (mShared && !(loaded = sharedRead(snap))) {
+			gLogEarly(LOG_WARNING, "bad shared configuration segment %s, using the database", mSharedPath.c_str());
+			sharedClose();
+			snap->mRecords.clear();
+		}
+	}
+	if (!loaded) {
+		sqlStatement query(mDB,"SELECT KEYSTRING,VALUESTRING FROM CONFIG");
+		if (!query.ok()) return snap;
+		sqlite3_stmt *stmt = query.stmt();
+		int src;
+		while ((src = query.step()) == SQLITE_ROW) {
+			const char* key = (const char*)sqlite3_column_text(stmt,0);
+			const char* value = (const char*)sqlite3_column_text(stmt,1);
+			// A NULL value reads as not set, as it does in cacheMiss.
+			if (key && value) { snap->mRecords[key] = ConfigurationRecord(key,value); }
+		}
+		if (src != SQLITE_DONE) {
+			// Busy or broken; leave it to cacheMiss, one key at a time.
+			gLogEarly(LOG_WARNING, "cannot preload configuration table, error message: %s", sqlite3_errmsg(mDB));
+			snap->mRecords.clear();
+			return snap;
+		}
+	}
+	for (ConfigurationKeyMap::const_iterator it = mSchema.begin(); it != mSchema.end(); it++) {
+		if (snap->mRecords.find(it->first) == snap->mRecords.end()) {
+			snap->mRecords[it->first] = ConfigurationRecord(it->first,it->second.getDefaultValue());
+		}
+	}
+	snap->mComplete = true;
+	return snap;
+}
+
+sqlite3_int64 ConfigurationTable::dataVersion()
 {
-	// mLock is set by caller 
-	static time_t timeOfLastPurge = 0;
+	// mLock is held by caller, or we are in the constructor.
+	if (mDB == NULL) return -1;
+	sqlStatement stmt(mDB,"PRAGMA data_version");
+	// An sqlite that does not know the pragma returns no rows.
+	if (stmt.ok() && stmt.step() == SQLITE_ROW) { return sqlite3_column_int64(stmt.stmt(),0); }
+	return -1;
+}
+
+void ConfigurationTable::checkForChanges()
+{
+	// mLock is held by caller
 	time_t now = time(NULL);
-	// purge every 3 seconds
-	// purge period cannot be configuration parameter
-	if (now - timeOfLastPurge < 3) return;
-	timeOfLastPurge = now;
-	// this is purge() without the lock
-	ConfigurationMap::iterator mp = mCache.begin();
-	while (mp != mCache.end()) {
-		ConfigurationMap::iterator prev = mp;
-		mp++;
-		mCache.erase(prev);
+	if (mShared && !mSharedPublisher) {
+		// The segment saves reading the table, but not asking sqlite whether it has changed, since the publisher only
+		// publishes changes that it notices, and it may be idle while the CLI or another reader writes.
+		sqlite3_int64 version = dataVersion();
+		if (sharedCurrent() && (version < 0 || version == mDataVersion)) return;
+		if (version >= 0) mDataVersion = version;
+	} else if (mDataVersion >= 0) {
+		sqlite3_int64 version = dataVersion();
+		if (version < 0 || version == mDataVersion) return;	// No change, or the database is busy; look next time.
+		mDataVersion = version;
+	} else {
+		// purge every 3 seconds
+		// purge period cannot be configuration parameter
+		if (now - mLastPurge < 3) return;
+		mLastPurge = now;
+	}
+	// Read it all again in one go rather than a key at a time as the cache refills.
+	ConfigurationSnapshot *next = preload();
+	notifyChanges(mSnapshot,next);
+	publish(next);
+	changed();
+	if (mSharedPublisher) mSharedDirty = true;		// The watcher, which is our caller, writes it next.
+	// Another process may have changed a Log.Level, so the LOG() call sites have to look again.
+	gLogConfigChanged();
+}
+
+
+/**@name The watcher thread.
+	Each table has one, started by the first read, that looks for changes by other processes once a second,
+	so that no reader ever waits for sqlite or reloads the table itself.
+	Threads do not survive fork, and a watcher may hold the lock of its table at the time, so every table is locked
+	around fork, and the child starts its watchers again when it first reads.
+*/
+//@{
+volatile unsigned ConfigurationTable::sForks = 0;
+static pthread_mutex_t sConfigTablesLock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<ConfigurationTable*> *sConfigTables = NULL;	// allocated on first use, since tables are made by static constructors
+
+void ConfigurationTable::forkRegister()
+{
+	pthread_atfork(forkPrepare,forkParent,forkChild);
+}
+
+static void configTableRegister(ConfigurationTable *table)
+{
+	pthread_mutex_lock(&sConfigTablesLock);
+	if (sConfigTables == NULL) sConfigTables = new std::vector<ConfigurationTable*>;
+	sConfigTables->push_back(table);
+	pthread_mutex_unlock(&sConfigTablesLock);
+}
+
+static void configTableUnregister(ConfigurationTable *table)
+{
+	pthread_mutex_lock(&sConfigTablesLock);
+	for (unsigned i = 0; i < sConfigTables->size(); i++) {
+		if ((*sConfigTables)[i] == table) {
+			sConfigTables->erase(sConfigTables->begin() + i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sConfigTablesLock);
+}
+
+void ConfigurationTable::forkPrepare()
+{
+	pthread_mutex_lock(&sConfigTablesLock);
+	for (unsigned i = 0; i < sConfigTables->size(); i++) { (*sConfigTables)[i]->mLock.lock(); }
+}
+
+void ConfigurationTable::forkParent()
+{
+	for (unsigned i = 0; i < sConfigTables->size(); i++) { (*sConfigTables)[i]->mLock.unlock(); }
+	pthread_mutex_unlock(&sConfigTablesLock);
+}
+
+void ConfigurationTable::forkChild()
+{
+	sForks++;
+	for (unsigned i = 0; i < sConfigTables->size(); i++) { (*sConfigTables)[i]->mLock.resetAfterFork(); }
+	pthread_mutex_unlock(&sConfigTablesLock);
+}
+
+void ConfigurationTable::startWatcher()
+{
+	ScopedLock lock(mLock);
+	if (mWatcherForks == sForks) return;
+	// The one from before a fork is not running in this process; its Thread is all that is left.
+	delete mWatcher;
+	mWatcher = NULL;
+	if (mDB) {
+		mWatcherStop = false;
+		mWatcher = new Thread();
+		mWatcher->start(watcherThread,this);
+	}
+	__sync_synchronize();
+	mWatcherForks = sForks;
+}
+
+void ConfigurationTable::stopWatcher()
+{
+	mLock.lock();
+	Thread *watcher = mWatcherForks == sForks ? mWatcher : NULL;
+	mWatcherStop = true;
+	mWatchSignal.signal();
+	mLock.unlock();
+	if (watcher) watcher->join();
+	ScopedLock lock(mLock);
+	delete mWatcher;
+	mWatcher = NULL;
+	mWatcherForks = ~0u;
+}
+
+// How long the watcher lets a burst of changes go on before it writes them all to one shared segment.
+static const unsigned sSharedDelayMs = 100;
+
+void *ConfigurationTable::watcherThread(void *arg)
+{
+	ConfigurationTable *table = (ConfigurationTable*) arg;
+	ScopedLock lock(table->mLock);
+	while (!table->mWatcherStop) {
+		table->mWatchSignal.wait(table->mLock,1000);
+		if (table->mWatcherStop) break;
+		if (table->mSharedDirty) {
+			table->mLock.unlock();
+			usleep(sSharedDelayMs * 1000);
+			table->mLock.lock();
+			if (table->mWatcherStop) break;
+		}
+		table->checkForChanges();
+		if (table->mSharedDirty && table->mSharedPublisher) table->sharedWrite();
+		table->mSharedDirty = false;
+	}
+	return NULL;
+}
+//@}
+
+
+/**@name The shared segment.
+	A segment is written once, in full, under a temporary name and renamed into place, so a reader never sees one half written;
+	after that the only change to it is mStale, which the publisher sets when it has renamed a newer one into place.
+	The publisher holds an exclusive flock on each segment it has in place, which the kernel drops if it dies,
+	so a reader that can take a shared lock knows the segment will never be marked stale.
+	The segment also has the file change counter of the database from before the rows were read; a reader only uses
+	a segment whose counter matches the database, so it does not load rows that a write the publisher missed has changed.
+	A reader copies the rows into its own snapshot and keeps the segment mapped only to watch mStale and the lock.
+	All values are in host byte order.
+*/
+//@{
+static const char sConfigSharedMagic[8] = { 'R','N','C','O','N','F','2',0 };
+
+struct ConfigurationSharedHeader {
+	char mMagic[8];
+	uint32_t mPid;				///< The publisher, for whoever is looking at /dev/shm.
+	volatile uint32_t mStale;	///< Set once a newer segment has replaced this one.
+	uint64_t mSize;				///< Size of the segment.
+	uint32_t mCount;			///< Number of rows, each a uint32_t key length, a uint32_t value length, the key and the value.
+	uint32_t mChangeCounter;	///< The file change counter of the database when the rows were read.
+};
+
+/**
+	Read the file change counter from the header of the database file; every commit by any connection changes it.
+	Unlike PRAGMA data_version, it is the same for every process, but it only works in rollback journal mode.
+*/
+static bool configChangeCounter(sqlite3 *db, uint32_t &counter)
+{
+	const char *filename = sqlite3_db_filename(db,"main");
+	if (filename == NULL || *filename == '\0') return false;
+	int fd = open(filename,O_RDONLY);
+	if (fd < 0) return false;
+	unsigned char bytes[4];
+	bool ok = pread(fd,bytes,sizeof(bytes),24) == sizeof(bytes);
+	close(fd);
+	counter = (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+	return ok;
+}
+
+void ConfigurationTable::sharedOpen()
+{
+	sharedClose();
+	if (mSharedPath.empty()) return;
+	// The name is easy to guess, so anyone could put a file there; only trust one that the database owner or we wrote,
+	// and that nobody else can change.
+	int fd = open(mSharedPath.c_str(),O_RDONLY|O_NOFOLLOW);
+	if (fd < 0) return;
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd,&st) == 0 && S_ISREG(st.st_mode) && st.st_size >= (off_t) sizeof(ConfigurationSharedHeader)) {
+		if ((st.st_uid != geteuid() && st.st_uid != mSharedOwner) || (st.st_mode & (S_IWGRP|S_IWOTH))) {
+			gLogEarly(LOG_WARNING, "ignoring shared configuration segment %s, which has the wrong owner or mode", mSharedPath.c_str());
+		} else {
+			map = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+		}
+	}
+	if (map == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	mSharedFd = fd;
+	mShared = (ConfigurationSharedHeader*) map;
+	mSharedSize = st.st_size;
+	uint32_t counter;
+	if (memcmp(mShared->mMagic,sConfigSharedMagic,sizeof(sConfigSharedMagic)) || mShared->mSize != mSharedSize || !sharedCurrent() ||
+		!configChangeCounter(mDB,counter) || counter != mShared->mChangeCounter) {
+		sharedClose();
+	}
+}
+
+void ConfigurationTable::sharedClose()
+{
+	if (mShared) munmap(mShared,mSharedSize);
+	if (mSharedFd >= 0) close(mSharedFd);
+	mSharedFd = -1;
+	mShared = NULL;
+	mSharedSize = 0;
+}
+
+bool ConfigurationTable::sharedCurrent() const
+{
+	if (mShared->mStale) return false;
+	// A segment whose publisher has gone will never be marked stale, but then nobody holds the exclusive lock.
+	if (flock(mSharedFd,LOCK_SH|LOCK_NB) == 0) {
+		flock(mSharedFd,LOCK_UN);
+		return false;
+	}
+	return errno == EWOULDBLOCK;
+}
+
+bool ConfigurationTable::sharedRead(ConfigurationSnapshot *snap) const
+{
+	const char *in = (const char*) (mShared + 1);
+	const char *end = (const char*) mShared + mSharedSize;
+	for (uint32_t i = 0; i < mShared->mCount; i++) {
+		uint32_t lengths[2];
+		if ((size_t)(end - in) < sizeof(lengths)) return false;
+		memcpy(lengths,in,sizeof(lengths));
+		in += sizeof(lengths);
+		if ((uint64_t)(end - in) < (uint64_t) lengths[0] + lengths[1]) return false;
+		string key(in,lengths[0]);
+		snap->mRecords[key] = ConfigurationRecord(key,string(in + lengths[0],lengths[1]));
+		in += lengths[0] + lengths[1];
+	}
+	return true;
+}
+
+bool ConfigurationTable::sharedWrite()
+{
+	// mLock is held by caller
+	ConfigurationSharedHeader header;
+	memset(&header,0,sizeof(header));
+	memcpy(header.mMagic,sConfigSharedMagic,sizeof(header.mMagic));
+	header.mPid = getpid();
+	// Read the counter first, so a commit that lands during the SELECT leaves the segment looking older than it is, not newer.
+	if (!configChangeCounter(mDB,header.mChangeCounter)) return false;
+	string buf((const char*) &header,sizeof(header));
+	sqlStatement query(mDB,"SELECT KEYSTRING,VALUESTRING FROM CONFIG");
+	if (!query.ok()) return false;
+	sqlite3_stmt *stmt = query.stmt();
+	int src;
+	while ((src = query.step()) == SQLITE_ROW) {
+		const char* key = (const char*)sqlite3_column_text(stmt,0);
+		const char* value = (const char*)sqlite3_column_text(stmt,1);
+		if (!key || !value) continue;
+		uint32_t lengths[2] = { (uint32_t) strlen(key), (uint32_t) strlen(value) };
+		buf.append((const char*) lengths,sizeof(lengths));
+		buf.append(key,lengths[0]);
+		buf.append(value,lengths[1]);
+		header.mCount++;
+	}
+	if (src != SQLITE_DONE) {
+		gLogEarly(LOG_WARNING, "cannot read configuration table to share it, error message: %s", sqlite3_errmsg(mDB));
+		return false;
+	}
+	header.mSize = buf.size();
+	buf.replace(0,sizeof(header),(const char*) &header,sizeof(header));
+
+	// mkstemp creates the file with O_EXCL, so it cannot be a file or link that someone else put there.
+	// The lock is taken before the rename, so no reader can find the new segment without it.
+	char tmp[120];
+	snprintf(tmp,sizeof(tmp),"%s.XXXXXX",mSharedPath.c_str());
+	int fd = mkstemp(tmp);
+	if (fd < 0 || fchmod(fd,0644) < 0 || flock(fd,LOCK_EX|LOCK_NB) < 0 ||
+		write(fd,buf.data(),buf.size()) != (ssize_t) buf.size() || rename(tmp,mSharedPath.c_str()) < 0) {
+		gLogEarly(LOG_WARNING, "cannot write shared configuration segment %s: %s", mSharedPath.c_str(), strerror(errno));
+		if (fd >= 0) { close(fd); unlink(tmp); }
+		return false;
 	}
+	void *map = mmap(NULL,buf.size(),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	// The new one is in place, so the readers of the old one can go and get it.
+	if (mShared) {
+		mShared->mStale = 1;
+		sharedClose();
+	}
+	if (map == MAP_FAILED) {
+		// Without the mapping we could not mark the new segment stale later, so take it away; readers go back to sqlite.
+		gLogEarly(LOG_ERR, "cannot map shared configuration segment %s: %s", mSharedPath.c_str(), strerror(errno));
+		unlink(mSharedPath.c_str());
+		close(fd);
+		return false;
+	}
+	mSharedFd = fd;
+	mShared = (ConfigurationSharedHeader*) map;
+	mSharedSize = buf.size();
+	return true;
+}
+
+bool ConfigurationTable::publishShared()
+{
+	ScopedLock lock(mLock);
+	if (mDB == NULL || mSharedPath.empty()) return false;
+	// The file change counter, which tells readers whether a segment is up to date, does not move in WAL mode.
+	sqlStatement mode(mDB,"PRAGMA journal_mode");
+	if (mode.ok() && mode.step() == SQLITE_ROW && strcasecmp((const char*) sqlite3_column_text(mode.stmt(),0),"wal") == 0) {
+		gLogEarly(LOG_WARNING, "cannot share configuration database in WAL mode");
+		return false;
+	}
+	if (!mSharedPublisher) sharedClose();
+	mSharedPublisher = true;
+	if (!sharedWrite()) {
+		mSharedPublisher = false;
+		return false;
+	}
+	// The watcher writes the segment again after each change.
+	startWatcher();
+	return true;
+}
+
+bool ConfigurationTable::unpublishShared()
+{
+	ScopedLock lock(mLock);
+	if (!mSharedPublisher) return false;
+	mSharedPublisher = false;
+	mSharedDirty = false;
+	if (mShared == NULL) return true;
+	// Take the name away only if it is still our segment, which it is unless another process has published since.
+	struct stat ours, named;
+	if (fstat(mSharedFd,&ours) == 0 && stat(mSharedPath.c_str(),&named) == 0 &&
+		ours.st_dev == named.st_dev && ours.st_ino == named.st_ino) {
+		unlink(mSharedPath.c_str());
+	}
+	// Readers go looking for a newer segment, find none, and go back to sqlite.
+	mShared->mStale = 1;
+	sharedClose();
+	return true;
 }
+//@}
 
 
 void ConfigurationTable::purge()
 {
 	ScopedLock lock(mLock);
-	ConfigurationMap::iterator mp = mCache.begin();
-	while (mp != mCache.end()) {
-		ConfigurationMap::iterator prev = mp;
-		mp++;
-		mCache.erase(prev);
+	ConfigurationSnapshot *next = new ConfigurationSnapshot;
+	notifyChanges(mSnapshot,next);
+	publish(next);
+	changed();
+	gLogConfigChanged();
+}
+
+
+/**@name Change notification.
+	Changes are queued as they are published, and the notifier thread waits a little after the first one
+	so that a burst of them reaches each subscriber as one call.
+*/
+//@{
+static const unsigned sNotifyDelayMs = 100;
+
+unsigned ConfigurationTable::subscribe(const string& keyOrPrefix, ConfigurationCallback callback, void *arg)
+{
+	ScopedLock lock(mNotifyLock);
+	Subscription sub;
+	sub.mId = mNextSubscription++;
+	sub.mPrefix = keyOrPrefix;
+	sub.mCallback = callback;
+	sub.mArg = arg;
+	mSubscriptions.push_back(sub);
+	mHaveSubscribers = true;
+	if (mNotifier == NULL) {
+		mNotifierStop = false;
+		mNotifySignal = new Signal();
+		mNotifier = new Thread();
+		mNotifier->start(notifierThread,this);
+	}
+	return sub.mId;
+}
+
+void ConfigurationTable::unsubscribe(unsigned id)
+{
+	ScopedLock lock(mNotifyLock);
+	for (unsigned i = 0; i < mSubscriptions.size(); i++) {
+		if (mSubscriptions[i].mId == id) {
+			mSubscriptions.erase(mSubscriptions.begin() + i);
+			break;
+		}
+	}
+	mHaveSubscribers = !mSubscriptions.empty();
+	while (mCalling == id) {
+		// A callback that unsubscribes itself would wait for itself.
+		if (pthread_equal(pthread_self(),mNotifierSelf)) return;
+		mCallDone.wait(mNotifyLock);
+	}
+}
+
+void ConfigurationTable::stopNotifications()
+{
+	mNotifyLock.lock();
+	Thread *notifier = mNotifier;
+	Signal *signal = mNotifySignal;
+	if (notifier) {
+		mNotifierStop = true;
+		signal->signal();
+	}
+	mNotifyLock.unlock();
+	if (notifier == NULL) return;
+	notifier->join();
+
+	ScopedLock lock(mNotifyLock);
+	mNotifier = NULL;
+	mNotifySignal = NULL;
+	mChangedKeys.clear();
+	mChangedAll = false;
+	delete notifier;
+	delete signal;
+}
+
+ConfigurationTable::~ConfigurationTable()
+{
+	stopNotifications();
+	stopWatcher();
+	if (!unpublishShared()) {
+		ScopedLock lock(mLock);
+		sharedClose();
+	}
+	configTableUnregister(this);
+}
+
+void ConfigurationTable::notify(const string& key)
+{
+	if (!mHaveSubscribers) return;
+	ScopedLock lock(mNotifyLock);
+	if (mNotifySignal == NULL) return;
+	mChangedKeys.insert(key);
+	mNotifySignal->signal();
+}
+
+void ConfigurationTable::notifyChanges(const ConfigurationSnapshot *before, const ConfigurationSnapshot *after)
+{
+	// mLock is held by caller
+	if (!mHaveSubscribers) return;
+	if (!before->mComplete || !after->mComplete) {
+		ScopedLock lock(mNotifyLock);
+		if (mNotifySignal == NULL) return;
+		mChangedAll = true;
+		mNotifySignal->signal();
+		return;
+	}
+	// A key that is missing from a complete snapshot is the same as one cached as not defined.
+	for (ConfigurationRecordTable::const_iterator it = after->mRecords.begin(); it != after->mRecords.end(); it++) {
+		const ConfigurationRecord *old = before->find(it->first);
+		bool wasDefined = old && old->defined();
+		if (wasDefined != it->second.defined() || (wasDefined && old->value() != it->second.value())) {
+			notify(it->first);
+		}
+	}
+	// The misses of a complete snapshot are schema defaults, which after has too, or keys that are not defined.
+	for (ConfigurationRecordTable::const_iterator it = before->mRecords.begin(); it != before->mRecords.end(); it++) {
+		if (it->second.defined() && after->find(it->first) == NULL) { notify(it->first); }
+	}
+}
+
+void *ConfigurationTable::notifierThread(void *arg)
+{
+	ConfigurationTable *table = (ConfigurationTable*) arg;
+	table->mNotifyLock.lock();
+	table->mNotifierSelf = pthread_self();
+	while (1) {
+		while (table->mChangedKeys.empty() && !table->mChangedAll && !table->mNotifierStop) { table->mNotifySignal->wait(table->mNotifyLock); }
+		if (table->mNotifierStop) break;
+		table->mNotifyLock.unlock();
+
+		// Let the rest of a burst arrive.
+		usleep(sNotifyDelayMs * 1000);
+
+		table->mNotifyLock.lock();
+		std::set<string> keys;
+		keys.swap(table->mChangedKeys);
+		bool all = table->mChangedAll;
+		table->mChangedAll = false;
+
+		// The callbacks run without the lock, so they can read the table, or even change it.
+		// The ids only grow, so the next subscription to call is the first one after the last one called;
+		// looking for it under the lock each time skips any that were unsubscribed meanwhile.
+		unsigned last = 0;
+		while (!table->mNotifierStop) {
+			const Subscription *next = NULL;
+			for (unsigned i = 0; i < table->mSubscriptions.size(); i++) {
+				if (table->mSubscriptions[i].mId > last) { next = &table->mSubscriptions[i]; break; }
+			}
+			if (next == NULL) break;
+			Subscription sub = *next;
+			last = sub.mId;
+			std::vector<string> matches;
+			if (!all) {
+				for (std::set<string>::const_iterator it = keys.begin(); it != keys.end(); it++) {
+					if (it->compare(0,sub.mPrefix.size(),sub.mPrefix) == 0) matches.push_back(*it);
+				}
+				if (matches.empty()) continue;
+			}
+			table->mCalling = sub.mId;
+			table->mNotifyLock.unlock();
+			sub.mCallback(matches,sub.mArg);
+			table->mNotifyLock.lock();
+			table->mCalling = 0;
+			table->mCallDone.broadcast();
+		}
 	}
+	table->mNotifyLock.unlock();
+	return NULL;
 }
+//@}
 
 
 void ConfigurationTable::setUpdateHook(void(*func)(void *,int ,char const *,char const *,sqlite3_int64))
@@ -967,17 +2119,27 @@ vector<string> ConfigurationTable::crossCheck(const string& key) {
 	return ret;
 }
 
-void HashString::computeHash()
+void configHandleRead(ConfigurationTable &table, const string &key, string &value) { value = table.getStr(key); }
+void configHandleRead(ConfigurationTable &table, const string &key, long &value) { value = table.getNum(key); }
+void configHandleRead(ConfigurationTable &table, const string &key, int &value) { value = table.getNum(key); }
+void configHandleRead(ConfigurationTable &table, const string &key, unsigned &value) { value = table.getNum(key); }
+void configHandleRead(ConfigurationTable &table, const string &key, float &value) { value = table.getFloat(key); }
+void configHandleRead(ConfigurationTable &table, const string &key, bool &value) { value = table.getBool(key); }
+void configHandleRead(ConfigurationTable &table, const string &key, vector<unsigned> &value) { value = table.getVector(key); }
+void configHandleRead(ConfigurationTable &table, const string &key, vector<string> &value) { value = table.getVectorOfStrings(key); }
+
+void configHandleCheckSchema(ConfigurationTable &table, const string &key)
 {
-	// FIXME -- Someone needs to review this hash function.
-	const char* cstr = c_str();
-	mHash = 0;
-	for (unsigned i=0; i<size(); i++) {
-		mHash = mHash ^ (mHash >> 32);
-		mHash = mHash*127 + cstr[i];
+	if (!table.keyDefinedInSchema(key)) {
+		LOG(WARNING) << "ConfigHandle for " << key << ", which is not in the schema";
 	}
 }
 
+void HashString::computeHash()
+{
+	mHash = hashOf(data(),size());
+}
+
 
 void SimpleKeyValue::addItem(const char* pair_orig)
 {
@@ -1242,7 +2404,7 @@ void ConfigurationKey::printDescription(const ConfigurationKey &key, ostream& os
 
 	} else if (key.getType() == ConfigurationKey::CHOICE) {
 		int startPos = -1;
-		uint endPos = 0;
+		size_t endPos = 0;
 
 		do {
 			startPos++;
@@ -33,11 +33,14 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <regex.h>
 
 #include <map>
+#include <set>
 #include <vector>
 #include <string>
 #include <sstream>
@@ -80,13 +83,30 @@ class ConfigurationRecord {
 	bool mDefined;
 	mutable bool mCRWarned;
 
+	/**
+		The value parsed as a list, the first time someone asks for it.
+		Copies of a record share one of these, so a parse done through any copy, in any snapshot, is kept for all of them.
+		Each list is set once and never changed; if two readers parse at the same time, the first to finish is kept.
+	*/
+	struct Parsed {
+		volatile int mRefs;
+		std::vector<unsigned> * volatile mNumbers;
+		std::vector<std::string> * volatile mStrings;
+		Parsed() : mRefs(1), mNumbers(NULL), mStrings(NULL) {}
+		~Parsed() { delete mNumbers; delete mStrings; }
+	};
+	Parsed *mParsed;	///< NULL for a record with no value
+
+	void release() { if (mParsed && __sync_sub_and_fetch(&mParsed->mRefs,1) == 0) delete mParsed; }
+
 	public:
 
-	ConfigurationRecord() : mDefined(false), mCRWarned(false) {}
+	ConfigurationRecord() : mDefined(false), mCRWarned(false), mParsed(NULL) {}
 	ConfigurationRecord(const std::string &key,bool wDefined):
 		mCRKey(key),
 		mDefined(wDefined),
-		mCRWarned(false)
+		mCRWarned(false),
+		mParsed(NULL)
 	{ }
 
 	ConfigurationRecord(const std::string&key, const std::string& wValue):
@@ -94,7 +114,8 @@ class ConfigurationRecord {
 		mValue(wValue),
 		//mNumber(strtol(wValue.c_str(),&endptr,0)),
 		mDefined(true),
-		mCRWarned(false)
+		mCRWarned(false),
+		mParsed(new Parsed)
 	{ }
 
 	ConfigurationRecord(const std::string&key, const char* wValue):
@@ -102,9 +123,25 @@ class ConfigurationRecord {
 		mValue(std::string(wValue)),
 		//mNumber(strtol(wValue.c_str(),&endptr,0)),
 		mDefined(true),
-		mCRWarned(false)
+		mCRWarned(false),
+		mParsed(new Parsed)
 	{ }
 
+	/** The copy shares the parsed lists. */
+	ConfigurationRecord(const ConfigurationRecord &other):
+		mCRKey(other.mCRKey),
+		mValue(other.mValue),
+		mDefined(other.mDefined),
+		mCRWarned(other.mCRWarned),
+		mParsed(other.mParsed)
+	{
+		if (mParsed) __sync_add_and_fetch(&mParsed->mRefs,1);
+	}
+
+	ConfigurationRecord& operator=(const ConfigurationRecord &other);
+
+	~ConfigurationRecord();
+
 
 	const std::string& value() const { return mValue; }
 	long number() const;
@@ -112,10 +149,21 @@ class ConfigurationRecord {
 
 	float floatNumber() const;
 
+	/** The value as a list of space separated numbers.  Parsed once for the record and its copies; good for as long as the record. */
+	const std::vector<unsigned>& numbers() const;
+
+	/** The value as a list of space separated words.  Parsed once for the record and its copies; good for as long as the record. */
+	const std::vector<std::string>& strings() const;
+
 };
 
 
-/** A string class that uses a hash function for comparison. */
+/**
+	A string class that carries its hash.
+	The equality tests look at the hash first and at the characters only when the hashes are equal,
+	so they are cheap for unequal strings and still correct when two strings collide.
+	The order is alphabetical, as for std::string, so a std::map keyed by HashString iterates in key order.
+*/
 class HashString : public std::string {
 
 
@@ -128,6 +176,17 @@ class HashString : public std::string {
 
 	public:
 
+	/** 64 bit FNV-1a. */
+	static uint64_t hashOf(const char *src, size_t len)
+	{
+		uint64_t hash = 14695981039346656037ULL;
+		for (size_t i = 0; i < len; i++) {
+			hash ^= (unsigned char) src[i];
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+
 	HashString(const char* src)
 		:std::string(src)
 	{
@@ -142,7 +201,7 @@ class HashString : public std::string {
 
 	HashString()
 	{
-		mHash=0;
+		computeHash();
 	}
 
 	HashString& operator=(std::string& src)
@@ -159,19 +218,24 @@ class HashString : public std::string {
 		return *this;
 	}
 
-	bool operator==(const HashString& other)
+	bool operator==(const HashString& other) const
+	{
+		return mHash==other.mHash && compare(other)==0;
+	}
+
+	bool operator!=(const HashString& other) const
 	{
-		return mHash==other.mHash;
+		return !(*this==other);
 	}
 
-	bool operator<(const HashString& other)
+	bool operator<(const HashString& other) const
 	{
-		return mHash<other.mHash;
+		return compare(other)<0;
 	}
 
-	bool operator>(const HashString& other)
+	bool operator>(const HashString& other) const
 	{
-		return mHash<other.mHash;
+		return other<*this;
 	}
 
 	uint64_t hash() const { return mHash; }
@@ -179,24 +243,231 @@ class HashString : public std::string {
 };
 
 
+/**
+	A hash table keyed by HashString, with the parts of the std::map interface that the config cache uses.
+	The entries are kept in a vector in the order they were added.  The buckets use open addressing with linear probing
+	and are never more than half full; each holds the full hash of its key, so a probe rejects other keys without
+	looking at them, and a matching hash is confirmed by comparing the strings.
+	Unlike std::map, adding or erasing an entry invalidates iterators, and erase() costs a rebuild of the buckets.
+*/
+template <class V> class HashStringTable {
+
+	public:
+
+	typedef std::pair<HashString,V> value_type;
+	typedef typename std::vector<value_type>::iterator iterator;
+	typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+	private:
+
+	struct Bucket {
+		uint64_t mHash;
+		unsigned mEntry;		///< Index in mEntries plus one, or 0 if the bucket is empty.
+	};
+
+	std::vector<value_type> mEntries;
+	std::vector<Bucket> mBuckets;	///< A power of two in size, or empty.
+
+	/** Return the bucket that has the key, or the empty bucket where it would go.  There must be buckets. */
+	unsigned probe(uint64_t hash, const char *key, size_t len) const
+	{
+		unsigned mask = mBuckets.size() - 1;
+		for (unsigned i = (unsigned) hash & mask; ; i = (i + 1) & mask) {
+			const Bucket &bucket = mBuckets[i];
+			if (bucket.mEntry == 0) return i;
+			if (bucket.mHash != hash) continue;
+			const HashString &other = mEntries[bucket.mEntry-1].first;
+			if (other.size() == len && memcmp(other.data(),key,len) == 0) return i;
+		}
+	}
+
+	/** Return the index of the entry for the key, or -1. */
+	int index(const char *key, size_t len) const
+	{
+		if (mBuckets.empty()) return -1;
+		return (int) mBuckets[probe(HashString::hashOf(key,len),key,len)].mEntry - 1;
+	}
+
+	void rebuild(unsigned size)
+	{
+		Bucket empty = { 0, 0 };
+		mBuckets.assign(size,empty);
+		unsigned mask = size - 1;
+		for (unsigned e = 0; e < mEntries.size(); e++) {
+			uint64_t hash = mEntries[e].first.hash();
+			unsigned i = (unsigned) hash & mask;
+			while (mBuckets[i].mEntry) { i = (i + 1) & mask; }
+			mBuckets[i].mHash = hash;
+			mBuckets[i].mEntry = e + 1;
+		}
+	}
+
+	public:
+
+	iterator begin() { return mEntries.begin(); }
+	iterator end() { return mEntries.end(); }
+	const_iterator begin() const { return mEntries.begin(); }
+	const_iterator end() const { return mEntries.end(); }
+	size_t size() const { return mEntries.size(); }
+	bool empty() const { return mEntries.empty(); }
+
+	iterator find(const std::string &key)
+	{
+		int i = index(key.data(),key.size());
+		return i < 0 ? end() : begin() + i;
+	}
+
+	const_iterator find(const std::string &key) const
+	{
+		int i = index(key.data(),key.size());
+		return i < 0 ? end() : begin() + i;
+	}
+
+	iterator find(const char *key) { int i = index(key,strlen(key)); return i < 0 ? end() : begin() + i; }
+	const_iterator find(const char *key) const { int i = index(key,strlen(key)); return i < 0 ? end() : begin() + i; }
+
+	/** Return the value for the key, adding a default one if it is not there. */
+	V& operator[](const std::string &key)
+	{
+		if (mBuckets.empty()) rebuild(16);
+		uint64_t hash = HashString::hashOf(key.data(),key.size());
+		unsigned i = probe(hash,key.data(),key.size());
+		if (mBuckets[i].mEntry) return mEntries[mBuckets[i].mEntry-1].second;
+		if (2 * (mEntries.size() + 1) > mBuckets.size()) {
+			rebuild(2 * mBuckets.size());
+			i = probe(hash,key.data(),key.size());
+		}
+		mEntries.push_back(value_type(HashString(key),V()));
+		mBuckets[i].mHash = hash;
+		mBuckets[i].mEntry = mEntries.size();
+		return mEntries.back().second;
+	}
+
+	void erase(iterator where)
+	{
+		mEntries.erase(where);
+		rebuild(mBuckets.size());
+	}
+
+	void clear()
+	{
+		mEntries.clear();
+		mBuckets.clear();
+	}
+};
+
+
 typedef std::map<std::string, ConfigurationRecord> ConfigurationRecordMap;
 typedef std::map<HashString, ConfigurationRecord> ConfigurationMap;
+/** What the cache keeps its records in; ConfigurationMap is the std::map it used to be, for code that uses that type. */
+typedef HashStringTable<ConfigurationRecord> ConfigurationRecordTable;
 class ConfigurationKey;
 typedef std::map<std::string, ConfigurationKey> ConfigurationKeyMap;
 ConfigurationKeyMap getConfigurationKeys();
 
+/** A key that a cache miss added to a snapshot after it was published. */
+struct ConfigurationMiss {
+	ConfigurationMiss *mNext;
+	HashString mKey;
+	ConfigurationRecord mRecord;
+	ConfigurationMiss(const std::string &wKey, const ConfigurationRecord &wRecord, ConfigurationMiss *wNext)
+		:mNext(wNext), mKey(wKey), mRecord(wRecord)
+	{ }
+};
+
+/**
+	An immutable copy of the cache.  Readers use whichever one is current without taking a lock.
+	The exception is mMisses: rather than copy the whole snapshot for one key, a cache miss adds the key to this list,
+	which only grows while the snapshot is current.  A copy of the snapshot folds the list into mRecords.
+*/
+struct ConfigurationSnapshot {
+	ConfigurationRecordTable mRecords;	///< Values, schema defaults and known-missing keys.
+	ConfigurationMiss * volatile mMisses;	///< More of the same, newest first; added to under ConfigurationTable::mLock.
+	unsigned mMissCount;
+	bool mComplete;				///< mRecords has the whole CONFIG table and every schema default, so a key not in it is not defined.
+	ConfigurationSnapshot() : mMisses(NULL), mMissCount(0), mComplete(false) {}
+	ConfigurationSnapshot(const ConfigurationSnapshot &other);
+	~ConfigurationSnapshot();
+
+	/** Return the record of the key from mRecords or mMisses, or NULL. */
+	const ConfigurationRecord *find(const std::string &key) const;
+
+	private:
+	ConfigurationSnapshot& operator=(const ConfigurationSnapshot&);
+};
+class ConfigurationReadGuard;
+class ConfigurationValidator;
+struct ConfigurationSharedHeader;
+
+/**
+	Called by the notifier thread with the keys that changed, or with no keys if the table was reloaded
+	and any of them may have changed.  arg is the one given to subscribe.
+*/
+typedef void (*ConfigurationCallback)(const std::vector<std::string>& keys, void *arg);
+
 /**
 	A class for maintaining a configuration key-value table,
 	based on sqlite3 and a local map-based cache.
 	Thread-safe, too.
+	The cache is published as a ConfigurationSnapshot through an atomic pointer, so the getters take no lock;
+	anything that changes the cache (a miss, set, remove or purge) builds a new snapshot under mLock and swaps it in.
+	Replaced snapshots are freed once no reader can still be looking at them.
 */
 class ConfigurationTable {
 
 	private:
 
 	sqlite3* mDB;				///< database connection
-	ConfigurationMap mCache;	///< cache of recently access configuration values
-	mutable Mutex mLock;		///< control for multithreaded access to the cache
+	ConfigurationSnapshot * volatile mSnapshot;	///< cache of recently access configuration values
+	std::vector<ConfigurationSnapshot*> mRetired;	///< replaced snapshots that a reader may still be using
+	volatile unsigned mGeneration;	///< bumped whenever a cached value may have changed
+	sqlite3_int64 mDataVersion;	///< PRAGMA data_version when the watcher last looked, or -1 if this sqlite does not have it
+	time_t mLastPurge;			///< when the cache was last emptied, if there is no data_version
+	mutable Mutex mLock;		///< serializes changes to the cache and access to the database
+	HashStringTable<ConfigurationValidator*> mValidators;	///< isValidValue checks, compiled from mSchema as needed
+	Mutex mValidatorLock;		///< protects mValidators
+
+	/**@name Change notification. */
+	//@{
+	struct Subscription {
+		unsigned mId;
+		std::string mPrefix;
+		ConfigurationCallback mCallback;
+		void *mArg;
+	};
+	std::vector<Subscription> mSubscriptions;
+	std::set<std::string> mChangedKeys;	///< changes the notifier has not delivered yet
+	bool mChangedAll;			///< the table was reloaded since the notifier last looked
+	unsigned mNextSubscription;
+	Thread *mNotifier;			///< started by the first subscribe, stopped by stopNotifications
+	pthread_t mNotifierSelf;	///< the notifier's own id, so unsubscribe can tell when a callback calls it
+	bool mNotifierStop;			///< tells the notifier to return
+	Signal *mNotifySignal;		///< made with mNotifier
+	unsigned mCalling;			///< the subscription whose callback is running, or 0
+	Signal mCallDone;			///< signalled when mCalling goes back to 0
+	Mutex mNotifyLock;			///< protects all of the above
+	volatile bool mHaveSubscribers;	///< lets changes skip mNotifyLock when nobody is listening
+	//@}
+
+	/**@name The watcher thread, which looks for changes by other processes; all protected by mLock. */
+	//@{
+	Thread *mWatcher;			///< started by the first read, stopped by the destructor
+	volatile unsigned mWatcherForks;	///< sForks when mWatcher was started; a fork leaves the child without it
+	bool mWatcherStop;			///< tells the watcher to return
+	Signal mWatchSignal;		///< wakes the watcher early
+	static volatile unsigned sForks;	///< bumped in the child by every fork
+	//@}
+
+	/**@name Sharing the table with other processes through /dev/shm; all protected by mLock. */
+	//@{
+	std::string mSharedPath;	///< the segment for this database file, or empty for :memory:
+	uid_t mSharedOwner;			///< owner of the database file, who may also have written the segment
+	int mSharedFd;				///< the open segment, which the publisher holds an flock on, or -1
+	ConfigurationSharedHeader *mShared;	///< the segment this process published or is reading, or NULL
+	size_t mSharedSize;
+	bool mSharedPublisher;		///< this process writes the segment
+	bool mSharedDirty;			///< the publisher has changed the table since the watcher last wrote the segment
+	//@}
 	std::vector<std::string> (*mCrossCheck)(const std::string&);	///< cross check callback pointer
 
 	public:
@@ -206,6 +477,13 @@ class ConfigurationTable {
 	// (pat) filename is the sql file name, wCmdName is the name of the executable we are running, used for better error messages.
 	ConfigurationTable(const char* filename = ":memory:", const char *wCmdName = 0, ConfigurationKeyMap wSchema = ConfigurationKeyMap());
 
+	/**
+		Stop the notifier thread, and remove the shared segment if this table published it.
+		The database connection and the cache are left for the process exit to clean up,
+		because a global table like gConfig can still be read by other static destructors and by threads that outlive main().
+	*/
+	~ConfigurationTable();
+
 	/** Generate an up-to-date example sql file for new installs. */
 	std::string getDefaultSQL(const std::string& program, const std::string& version);
 
@@ -251,6 +529,8 @@ class ConfigurationTable {
 
 	/**
 		Get a vector of strings from the table.
+		The value is parsed once and kept with the cached record, but this returns a copy, which allocates on every call.
+		Only ConfigHandle< std::vector<std::string> >::ref() avoids the copy.
 	*/
 	std::vector<std::string> getVectorOfStrings(const std::string& key);
 
@@ -262,12 +542,31 @@ class ConfigurationTable {
 
 	/**
 		Get a numeric vector from the table.
+		Parsed once and kept with the cached record, and copied on every call, like getVectorOfStrings.
 	*/
 	std::vector<unsigned> getVector(const std::string& key);
 
 	/** Get length of a vector */
-	unsigned getVectorLength(const std::string &key) 
-		{ return getVector(key).size(); }
+	unsigned getVectorLength(const std::string &key);
+
+	/**
+		Make this process the one that publishes the table to the other processes that use the same database file.
+		The rows of the CONFIG table are written to a read-only segment in /dev/shm, and written again, as a new segment,
+		by the watcher thread, shortly after this process changes them or as soon as it sees that another process has.
+		Until then, other processes see that the segment is behind the database and read sqlite instead.
+		A ConfigurationTable in another process loads from the segment instead of sqlite, as long as the segment is up to date
+		with the database, was written by the database owner or by its own user, and cannot be written by anyone else.
+		It still asks sqlite whether anything has changed.  If there is no such segment, or its publisher has exited,
+		it uses sqlite as usual.  Writes always go to sqlite.
+		Only one process should publish.  Returns false if the table cannot be published, eg, it is in memory or in WAL mode.
+	*/
+	bool publishShared();
+
+	/** Stop publishing and remove the segment; the destructor does this too.  Returns false if this table was not publishing. */
+	bool unpublishShared();
+
+	/** Return true if this table loaded its cache from the segment of another table and is watching it for changes. */
+	bool readingShared() const { return mShared && !mSharedPublisher; }
 
 	/** Set or change a value in the table.  */
 	bool set(const std::string& key, const std::string& value);
@@ -275,6 +574,15 @@ class ConfigurationTable {
 	/** Set or change a value in the table.  */
 	bool set(const std::string& key, long value);
 
+	/**
+		Set or change several values at once, eg, to apply a profile from the CLI.
+		Every value of a key in the schema is checked with isValidValue first; if any fails, nothing is written,
+		and the keys that failed are added to invalidKeys, if given.
+		Otherwise the values are written in one transaction, and readers see all of them at once or none.
+		@return true if all of the values were written.
+	*/
+	bool setMany(const std::map<std::string,std::string>& values, std::vector<std::string> *invalidKeys = NULL);
+
 	/**
 		Remove an entry from the table.
 		Will not alter required values.
@@ -298,22 +606,266 @@ class ConfigurationTable {
 	/** Execute the application specific value cross checking logic. */
 	std::vector<std::string> crossCheck(const std::string& key);
 
-	/** purege cache if it exceeds a certain age */
-	void checkCacheAge();
+	/**
+		Have callback called when a key that starts with keyOrPrefix changes; "" means any key.
+		The calls come from a notifier thread, which the first subscription starts, so the callback must not block for long.
+		Changes that arrive close together, eg, from a script of CLI commands, are delivered in one call.
+		Changes by other processes are seen when the watcher thread finds them, within a second or so.
+		Returns an id for unsubscribe.
+	*/
+	unsigned subscribe(const std::string& keyOrPrefix, ConfigurationCallback callback, void *arg = NULL);
+
+	/**
+		Stop calling a subscription.  If its callback is running, wait for it to return, unless this is called from a callback,
+		so once this returns, arg is no longer used.
+	*/
+	void unsubscribe(unsigned id);
+
+	/**
+		Stop and join the notifier thread; changes that it has not delivered yet are dropped.
+		Call this before the exit of a program whose callbacks use objects that static destruction may have destroyed.
+		A later subscribe starts the notifier again.  Must not be called from a callback.
+	*/
+	void stopNotifications();
+
+	/**
+		Make sure the watcher thread is running.  Once a second it looks for changes made to the database by other
+		processes, eg, the CLI, and reloads the cache if there are any, so readers never wait for sqlite.
+		Changes made through this table update the cache as they happen.
+		Without PRAGMA data_version (sqlite before 3.8.8) the cache is simply emptied every 3 seconds.
+		The getters call this, so the watcher starts with the first read, and again in the child after a fork.
+	*/
+	void checkCacheAge() { if (mWatcherForks != sForks) startWatcher(); }
 
 	/** Delete all records from the cache. */
 	void purge();
 
+	/** Changes whenever a value may have changed; ConfigHandle compares this to decide if it has to read the key again. */
+	unsigned generation() const { return mGeneration; }
+
 
 	private:
 
 	/**
 		Attempt to lookup a record, cache if needed.
 		Throw ConfigurationTableKeyNotFound if not found.
-		Caller should hold mLock because the returned reference points into the cache.
+		The returned reference points into the snapshot held by guard, so it is good until guard goes away.
+	*/
+	const ConfigurationRecord& lookup(const std::string& key, ConfigurationReadGuard &guard);
+
+	/** Read a key that is not in the cache from the database and add it to the current snapshot. */
+	void cacheMiss(const std::string& key);
+
+	/**
+		Read the whole CONFIG table with one SELECT and merge it with the schema defaults.
+		Returns a complete snapshot, or an empty one if the table could not be read.  Caller holds mLock.
 	*/
-	const ConfigurationRecord& lookup(const std::string& key);
+	ConfigurationSnapshot *preload();
+
+	/** Make next the current snapshot.  Caller holds mLock. */
+	void publish(ConfigurationSnapshot *next);
+
+	/** Reload the cache if another process has changed the database.  The watcher calls this holding mLock. */
+	void checkForChanges();
+
+	/** The slow part of checkCacheAge. */
+	void startWatcher();
+	void stopWatcher();
+	static void *watcherThread(void *table);
+
+	/**@name Lock every table around fork, so the child does not inherit a lock held by a watcher. */
+	//@{
+	static void forkRegister();
+	static void forkPrepare();
+	static void forkParent();
+	static void forkChild();
+	//@}
+
+	/** Return PRAGMA data_version, which changes when another connection commits, or -1. */
+	sqlite3_int64 dataVersion();
+
+	/**@name The shared segment.  Caller holds mLock, or we are in the constructor. */
+	//@{
+	/** Map the current segment of another process, if there is one, in place of the one we have. */
+	void sharedOpen();
+	void sharedClose();
+	/** Return true if the segment we are reading is still the current one. */
+	bool sharedCurrent() const;
+	/** Add the rows in the segment to snap.  Return false if the segment is malformed. */
+	bool sharedRead(ConfigurationSnapshot *snap) const;
+	/** Write the rows of the database to a new segment and mark the old one stale.  Only the watcher and publishShared call this. */
+	bool sharedWrite();
+	/** After a change by the publisher, have the watcher write a new segment once the burst of changes is over. */
+	void sharedChanged() { if (mSharedPublisher) { mSharedDirty = true; mWatchSignal.signal(); } }
+	//@}
+
+	/** Write a value to the database, but not the cache.  Caller holds mLock. */
+	bool writeValue(const std::string& key, const std::string& value);
+
+	/** Note that values may have changed, after the snapshot that has the changes is published. */
+	void changed() { __sync_add_and_fetch(&mGeneration,1); }
+
+	/** Queue a change of key for the subscribers. */
+	void notify(const std::string& key);
+
+	/** Queue the keys that differ between two snapshots, or a reload if either is not complete.  Caller holds mLock. */
+	void notifyChanges(const ConfigurationSnapshot *before, const ConfigurationSnapshot *after);
+
+	static void *notifierThread(void *table);
+
+};
 
+
+/**@name Reading a key as a given type, for ConfigHandle. */
+//@{
+void configHandleRead(ConfigurationTable &table, const std::string &key, std::string &value);
+void configHandleRead(ConfigurationTable &table, const std::string &key, long &value);
+void configHandleRead(ConfigurationTable &table, const std::string &key, int &value);
+void configHandleRead(ConfigurationTable &table, const std::string &key, unsigned &value);
+void configHandleRead(ConfigurationTable &table, const std::string &key, float &value);
+void configHandleRead(ConfigurationTable &table, const std::string &key, bool &value);
+void configHandleRead(ConfigurationTable &table, const std::string &key, std::vector<unsigned> &value);
+void configHandleRead(ConfigurationTable &table, const std::string &key, std::vector<std::string> &value);
+/** Warn once if a ConfigHandle is bound to a key the schema does not know about. */
+void configHandleCheckSchema(ConfigurationTable &table, const std::string &key);
+/** Pin a cell in the calling thread's ConfigHandle hazard slot, so it is not freed until configHandleUnpin(). */
+void configHandlePin(const void *cell);
+void configHandleUnpin();
+/** Return true if any thread has the cell pinned. */
+bool configHandlePinned(const void *cell);
+//@}
+
+/**
+	A configuration value bound to one key and kept parsed as a T.
+	Reading it costs ConfigurationTable::checkCacheAge() and a comparison of ConfigurationTable::generation() with the generation of the cached value;
+	only when the table has changed is the key looked up and parsed again.
+	Use like this:
+		static ConfigHandle<long> sT3212(gConfig,"GSM.Timer.T3212");
+		... sT3212.get() ...
+	The handle does not touch the table until the first get().  A function-local static, as above, is constructed the first time
+	the function runs, so it is safe anywhere.  A handle at file scope has constructors to run (for the key and the lock),
+	so it must not be used from the static initializers of another file, which may run before them.
+	Each value is kept in its own cell, and get() copies the value out of the cell without taking a lock, pinning the cell
+	in the calling thread's hazard slot only while it copies.  For a vector, where the copy allocates, ref() returns a Ref
+	that keeps the cell alive as long as the Ref exists instead.  When the value changes, the old cell is retired, and
+	a later change frees it once no thread has it pinned and no Ref holds it.
+	get() and ref() throw ConfigurationTableKeyNotFound like the ConfigurationTable getters.
+*/
+template <class T> class ConfigHandle {
+	struct Cell {
+		volatile unsigned mGeneration;	///< table generation this value was last confirmed at
+		T mValue;
+		volatile int mRefs;				///< Refs that hold this cell
+		Cell *mOlder;					///< next in mRetired
+	};
+
+	ConfigurationTable &mTable;
+	std::string mKey;
+	Cell * volatile mCell;
+	Cell *mRetired;		///< replaced cells that were still in use the last time we looked
+	Mutex mLock;		///< serializes refresh()
+
+	/** Free the retired cells that no thread has pinned or holds a Ref to.  Caller holds mLock. */
+	void reclaim() {
+		Cell **link = &mRetired;
+		while (Cell *cell = *link) {
+			// Pins first: a reader takes its Ref before it unpins.
+			if (configHandlePinned(cell) || cell->mRefs) { link = &cell->mOlder; continue; }
+			*link = cell->mOlder;
+			delete cell;
+		}
+	}
+
+	/** Bring the cell up to date with the table and return it, pinned. */
+	Cell *refresh() {
+		ScopedLock lock(mLock);
+		// Sample the generation first so a change that happens while we are reading is not lost.
+		unsigned gen = mTable.generation();
+		Cell *cell = mCell;
+		if (cell && cell->mGeneration == gen) {
+			// Only a refresh() retires cells, so pinning under mLock needs no second look at mCell.
+			configHandlePin(cell);
+			return cell;
+		}
+		if (cell == NULL) { configHandleCheckSchema(mTable,mKey); }
+		T value;
+		configHandleRead(mTable,mKey,value);
+		if (cell && cell->mValue == value) {
+			cell->mGeneration = gen;
+			configHandlePin(cell);
+			return cell;
+		}
+		Cell *next = new Cell;
+		next->mGeneration = gen;
+		next->mValue = value;
+		next->mRefs = 0;
+		next->mOlder = NULL;
+		configHandlePin(next);
+		__sync_synchronize();
+		mCell = next;
+		if (cell) {
+			cell->mOlder = mRetired;
+			mRetired = cell;
+			reclaim();
+		}
+		return next;
+	}
+
+	/** Return the current cell, pinned; the caller unpins it. */
+	Cell *pinCurrent() {
+		mTable.checkCacheAge();
+		while (1) {
+			Cell *cell = mCell;
+			if (cell == NULL || cell->mGeneration != mTable.generation()) return refresh();
+			configHandlePin(cell);
+			// A cell that is still current after we pinned it cannot have been retired before.
+			if (cell == mCell) return cell;
+		}
+	}
+
+	public:
+	/** Holds the value of a handle, as it was when ref() was called; must not outlive the handle. */
+	class Ref {
+		Cell *mCell;
+		public:
+		explicit Ref(Cell *wCell) : mCell(wCell) { }
+		Ref(const Ref &other) : mCell(other.mCell) { __sync_fetch_and_add(&mCell->mRefs,1); }
+		~Ref() { __sync_fetch_and_sub(&mCell->mRefs,1); }
+		const T& operator*() const { return mCell->mValue; }
+		const T* operator->() const { return &mCell->mValue; }
+		private:
+		Ref& operator=(const Ref&);
+	};
+
+	ConfigHandle(ConfigurationTable &wTable, const std::string &wKey) : mTable(wTable), mKey(wKey), mCell(NULL), mRetired(NULL) { }
+	~ConfigHandle() {
+		delete mCell;
+		for (Cell *cell = mRetired; cell; ) { Cell *older = cell->mOlder; delete cell; cell = older; }
+	}
+
+	const std::string &key() const { return mKey; }
+
+	/** The current value, parsed. */
+	T get() {
+		Cell *cell = pinCurrent();
+		T value = cell->mValue;
+		configHandleUnpin();
+		return value;
+	}
+	operator T() { return get(); }
+
+	/** The current value, parsed, without copying it. */
+	Ref ref() {
+		Cell *cell = pinCurrent();
+		__sync_fetch_and_add(&cell->mRefs,1);
+		configHandleUnpin();
+		return Ref(cell);
+	}
+
+	private:
+	// Not copyable: Refs point into the cells.
+	ConfigHandle(const ConfigHandle&);
+	ConfigHandle& operator=(const ConfigHandle&);
 };
 
 
@@ -30,6 +30,7 @@
 #include "Configuration.h"
 #include <iostream>
 #include <string>
+#include <unistd.h>
 
 using namespace std;
 
@@ -42,6 +43,13 @@ void purgeConfig(void*,int,char const*, char const*, sqlite3_int64)
 	gConfig.purge();
 }
 
+void printChanges(const std::vector<std::string>& keys, void*)
+{
+	cout << "changed:";
+	for (unsigned i = 0; i < keys.size(); i++) cout << " " << keys[i];
+	cout << endl;
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -106,6 +114,76 @@ int main(int argc, char *argv[])
 	} catch (ConfigurationTableKeyNotFound) {
 		cout << "ConfigurationTableKeyNotFound exception successfully caught." << endl;
 	}
+
+	ConfigHandle<long> num(gConfig,"numnumber");
+	ConfigHandle<std::vector<unsigned> > vhandle(gConfig,"key5");
+	cout << "handle numnumber " << num.get() << endl;
+	gConfig.set("numnumber",7);
+	cout << "handle numnumber " << num.get() << endl;
+	gConfig.remove("numnumber");
+	cout << "handle numnumber " << num.get() << endl;
+	cout << "handle key5 length " << vhandle.ref()->size() << endl;
+
+	// A change through another connection, standing in for another process, shows up within a second.
+	{
+		ConfigurationTable other("exampleconfig.db");
+		other.set("key1","from another connection");
+		sleep(2);
+		cout << "table[key1]=" << gConfig.getStr("key1") << endl;
+		other.set("key1",0L);
+	}
+
+	// A burst of changes reaches a subscriber as one call.
+	// The update hook purges the cache on every change, which a subscriber hears as a reload of everything, so drop it.
+	gConfig.setUpdateHook(NULL);
+	unsigned sub = gConfig.subscribe("sub.",printChanges);
+	gConfig.set("sub.a",1);
+	gConfig.set("sub.b",2);
+	gConfig.set("other",3);
+	sleep(1);
+	gConfig.unsubscribe(sub);
+	gConfig.remove("sub.a");
+	gConfig.remove("sub.b");
+	gConfig.remove("other");
+
+	// setMany writes nothing unless every value is valid.
+	std::map<std::string,std::string> batch;
+	batch["booltest"] = "2";
+	batch["key2"] = "22";
+	std::vector<std::string> invalid;
+	cout << "setMany " << gConfig.setMany(batch,&invalid) << " invalid " << invalid.size() << " " << invalid[0] << " key2 " << gConfig.getStr("key2") << endl;
+	batch["booltest"] = "1";
+	cout << "setMany " << gConfig.setMany(batch) << " booltest " << gConfig.getStr("booltest") << " key2 " << gConfig.getStr("key2") << endl;
+	gConfig.set("booltest",0);
+
+	// Values that have none of the delimiter a check looks for.
+	cout << "valid ipport 1.2.3.4 " << gConfig.isValidValue("ipport","1.2.3.4") << " 1.2.3.4:80 " << gConfig.isValidValue("ipport","1.2.3.4:80") << endl;
+	cout << "valid choice b " << gConfig.isValidValue("choice","b") << " a,b,c " << gConfig.isValidValue("choice","a,b,c") << endl;
+	cout << "valid described y " << gConfig.isValidValue("described","y") << " z " << gConfig.isValidValue("described","z") << endl;
+
+	// Once gConfig publishes the table, another table on the same file reads it from shared memory.
+	cout << "publishShared " << gConfig.publishShared() << endl;
+	{
+		// A write behind gConfig's back makes the segment out of date, so a reader loads from sqlite.
+		sqlite3 *db;
+		sqlite3_open("exampleconfig.db",&db);
+		sqlite3_command(db,"UPDATE CONFIG SET VALUESTRING='behind' WHERE KEYSTRING='key3'");
+		ConfigurationTable stale("exampleconfig.db");
+		cout << "stale reader shared " << stale.readingShared() << " table[key3]=" << stale.getStr("key3") << endl;
+
+		// Once gConfig's watcher has published again, shortly after the change, the segment is good.
+		gConfig.set("key3","shared");
+		sleep(1);
+		ConfigurationTable reader("exampleconfig.db");
+		cout << "reader shared " << reader.readingShared() << " table[key3]=" << reader.getStr("key3") << endl;
+
+		// The reader still sees a change that gConfig has not published.
+		sqlite3_command(db,"UPDATE CONFIG SET VALUESTRING='direct' WHERE KEYSTRING='key3'");
+		sleep(2);
+		cout << "reader shared " << reader.readingShared() << " table[key3]=" << reader.getStr("key3") << endl;
+		sqlite_close(db);
+	}
+	cout << "unpublishShared " << gConfig.unpublishShared() << endl;
 }
 
 ConfigurationKeyMap getConfigurationKeys()
@@ -146,5 +224,38 @@ ConfigurationKeyMap getConfigurationKeys()
 	map[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("ipport","127.0.0.1:5700",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::IPANDPORT,
+		"",
+		false,
+		""
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("choice","a",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::CHOICE,
+		"a,b,c",
+		false,
+		""
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("described","x",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::CHOICE,
+		"x|first,y|second",
+		false,
+		""
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
 	return map;
 }
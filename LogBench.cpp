@@ -0,0 +1,195 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under the terms of the GNU Affero Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// Measure what LOG() costs the calling thread.
+// Usage: LogBench [-a] [-d] [-t maxThreads] [-n callsPerThread] [-f logFile]
+//   -a  use the async writer (Log.Async)
+//   -d  use the direct syslog sink (Log.Syslog.Direct)
+// Each scenario is run with 1, 2, 4 ... maxThreads threads and prints one line of name=value pairs to stdout:
+//   suppressed  LOG(DEBUG) below the logging level
+//   syslog      LOG(NOTICE) to syslog
+//   console     LOG(NOTICE) to syslog and the console, with stderr sent to /dev/null
+//   file        LOG(NOTICE) to syslog and the log file
+// Syslog is always on, so the console and file numbers include it.
+// The latencies are of single calls, timed with CLOCK_MONOTONIC, so they include the cost of reading the clock,
+// which is reported once as clock_ns.
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "Logger.h"
+#include "Threads.h"
+#include "Configuration.h"
+
+ConfigurationTable gConfig;
+
+static inline uint64_t nsecs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct BenchThread {
+	Thread mThread;
+	bool mEmit;						// LOG(NOTICE) if set, else LOG(DEBUG).
+	unsigned mCalls;
+	std::vector<uint32_t> mLatency;	// nsecs of each call.
+	uint64_t mStart, mEnd;
+};
+
+static volatile int sBenchReady;
+static volatile int sBenchGo;
+
+static void *benchThread(void *arg)
+{
+	BenchThread *bt = (BenchThread*) arg;
+	bt->mLatency.resize(bt->mCalls);
+	__sync_fetch_and_add(&sBenchReady,1);
+	while (!sBenchGo) { sched_yield(); }
+	bt->mStart = nsecs();
+	for (unsigned i = 0; i < bt->mCalls; i++) {
+		uint64_t before = nsecs();
+		// The counter keeps Log.FoldRepeats from folding the records.
+		if (bt->mEmit) {
+			LOG(NOTICE) << "benchmark record " << i << " of " << bt->mCalls;
+		} else {
+			LOG(DEBUG) << "benchmark record " << i << " of " << bt->mCalls;
+		}
+		bt->mLatency[i] = nsecs() - before;
+	}
+	bt->mEnd = nsecs();
+	return NULL;
+}
+
+static uint32_t percentile(const std::vector<uint32_t> &sorted, double fraction)
+{
+	if (sorted.empty()) return 0;
+	size_t i = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+	return sorted[i];
+}
+
+static void runScenario(const char *name, bool emit, unsigned threads, unsigned calls)
+{
+	std::vector<BenchThread*> bts;
+	sBenchReady = 0;
+	sBenchGo = 0;
+	for (unsigned t = 0; t < threads; t++) {
+		BenchThread *bt = new BenchThread;
+		bt->mEmit = emit;
+		bt->mCalls = calls;
+		bt->mThread.start(benchThread,bt);
+		bts.push_back(bt);
+	}
+	while (sBenchReady != (int) threads) { sched_yield(); }
+	unsigned long dropped = gLogDroppedCount();
+	sBenchGo = 1;
+
+	std::vector<uint32_t> all;
+	all.reserve((size_t) threads * calls);
+	uint64_t start = ~0ULL, end = 0, busy = 0;
+	for (unsigned t = 0; t < threads; t++) {
+		BenchThread *bt = bts[t];
+		bt->mThread.join();
+		if (bt->mStart < start) start = bt->mStart;
+		if (bt->mEnd > end) end = bt->mEnd;
+		busy += bt->mEnd - bt->mStart;
+		all.insert(all.end(),bt->mLatency.begin(),bt->mLatency.end());
+		delete bt;
+	}
+	gLogFlush();
+	dropped = gLogDroppedCount() - dropped;
+	std::sort(all.begin(),all.end());
+
+	uint64_t total = (uint64_t) threads * calls;
+	double seconds = (end - start) / 1e9;
+	printf("scenario=%s threads=%u calls=%llu ns_per_call=%.1f p50_ns=%u p99_ns=%u p999_ns=%u max_ns=%u calls_per_sec=%.0f dropped=%lu\n",
+		name, threads, (unsigned long long) total, (double) busy / total,
+		percentile(all,0.50), percentile(all,0.99), percentile(all,0.999), all.empty() ? 0 : all.back(),
+		seconds > 0 ? total / seconds : 0.0, dropped);
+	fflush(stdout);
+}
+
+static void runAll(const char *name, bool emit, unsigned maxThreads, unsigned calls)
+{
+	for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+		runScenario(name,emit,threads,calls);
+		if (threads < maxThreads && threads * 2 > maxThreads) { runScenario(name,emit,maxThreads,calls); }
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned maxThreads = 4;
+	unsigned calls = 100000;
+	const char *logFile = "/tmp/LogBench.log";
+	int opt;
+	while ((opt = getopt(argc,argv,"adt:n:f:")) != -1) {
+		switch (opt) {
+			case 'a': gConfig.set("Log.Async","1"); break;
+			case 'd': gConfig.set("Log.Syslog.Direct","1"); break;
+			case 't': maxThreads = atoi(optarg); break;
+			case 'n': calls = atoi(optarg); break;
+			case 'f': logFile = optarg; break;
+			default:
+				fprintf(stderr,"usage: %s [-a] [-d] [-t maxThreads] [-n callsPerThread] [-f logFile]\n",argv[0]);
+				return 2;
+		}
+	}
+	if (maxThreads < 1) maxThreads = 1;
+
+	// No sampling or rate limits from the config; this measures the whole path.
+	gLogInit("LogBench","NOTICE",LOG_LOCAL7);
+
+	uint64_t before = nsecs();
+	for (int i = 0; i < 1000; i++) { nsecs(); }
+	printf("clock_ns=%.1f async=%d direct_syslog=%d\n",(nsecs() - before) / 1000.0,
+		(int) gConfig.getBool("Log.Async"),(int) gConfig.getBool("Log.Syslog.Direct"));
+
+	runAll("suppressed",false,maxThreads,calls);
+	runAll("syslog",true,maxThreads,calls);
+
+	int saved = dup(2);
+	int devnull = open("/dev/null",O_WRONLY);
+	dup2(devnull,2);
+	gLogToConsole = true;
+	runAll("console",true,maxThreads,calls);
+	gLogToConsole = false;
+	dup2(saved,2);
+	close(devnull);
+	close(saved);
+
+	unlink(logFile);
+	gLogInitWithFile("LogBench",NULL,LOG_LOCAL7,(char*) logFile);
+	runAll("file",true,maxThreads,calls);
+	return 0;
+}
+
+// vim: ts=4 sw=4
@@ -0,0 +1,167 @@
+/*
+* Copyright 2014 Range Networks, Inc.
+*
+* This software is distributed under the terms of the GNU Affero Public License.
+* See the COPYING file in the main directory for details.
+*
+* This use of this software may be subject to additional restrictions.
+* See the LEGAL file in the main directory for details.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// Decode binary log segments written by BLOG() into the text format of LOG().
+// Usage: LogDecode segment...
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "BinaryLog.h"
+#include "Configuration.h"
+
+ConfigurationTable gConfig;
+
+struct DecodedSite {
+	std::string mFile;
+	unsigned mLine;
+	std::string mFunction;
+	std::vector<std::string> mNames;
+};
+
+static const char *getString(const char *in, const char *end, std::string &out)
+{
+	uint16_t len;
+	if (in == NULL || end - in < 2) return NULL;
+	memcpy(&len,in,2);
+	if (end - in < 2 + len) return NULL;
+	out.assign(in+2,len);
+	return in + 2 + len;
+}
+
+static bool decodeSite(const BinaryLogEntry *entry, DecodedSite &site)
+{
+	const char *in = (const char*) entry + sizeof(BinaryLogEntry);
+	const char *end = (const char*) entry + entry->mLength;
+	uint32_t line;
+	if (end - in < 4) return false;
+	memcpy(&line,in,4);
+	site.mLine = line;
+	in = getString(in+4,end,site.mFile);
+	in = getString(in,end,site.mFunction);
+	site.mNames.resize(entry->mCount);
+	for (unsigned i = 0; i < entry->mCount; i++) { in = getString(in,end,site.mNames[i]); }
+	return in != NULL;
+}
+
+// Return the entry at or after offset, moving offset to it, or NULL at the end of the segment.
+// A writer that died between claiming its space and writing the length leaves zeros, which are
+// stepped over 8 bytes at a time; any other entry, finished or not, is stepped over whole.
+static const BinaryLogEntry *entryAt(const char *base, uint64_t &offset, uint64_t used)
+{
+	for (; offset + sizeof(BinaryLogEntry) <= used; offset += 8) {
+		const BinaryLogEntry *entry = (const BinaryLogEntry*) (base + offset);
+		if (entry->mLength >= sizeof(BinaryLogEntry) && (entry->mLength & 7) == 0 && offset + entry->mLength <= used) return entry;
+	}
+	return NULL;
+}
+
+// The same as gLogTimestamp, but for the time of the record.
+static void printTime(std::ostream &os, uint64_t usecs)
+{
+	time_t seconds = usecs / 1000000;
+	struct tm tm;
+	localtime_r(&seconds,&tm);
+	char buf[40];
+	snprintf(buf,sizeof(buf)," %04d-%02d-%02dT%02d:%02d:%02d.%d",tm.tm_year+1900,tm.tm_mon+1,tm.tm_mday,
+		tm.tm_hour,tm.tm_min,tm.tm_sec,(int)(usecs % 1000000 / 100000));
+	os << buf;
+}
+
+static bool decodeSegment(const char *path)
+{
+	int fd = open(path,O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd,&st) < 0 || st.st_size < (off_t) sizeof(BinaryLogHeader)) {
+		std::cerr << path << ": cannot read" << std::endl;
+		if (fd >= 0) close(fd);
+		return false;
+	}
+	void *map = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	const BinaryLogHeader *header = (const BinaryLogHeader*) map;
+	if (map == MAP_FAILED || memcmp(header->mMagic,sBinaryLogMagic,sizeof(header->mMagic))) {
+		std::cerr << path << ": not a binary log segment" << std::endl;
+		if (map != MAP_FAILED) munmap(map,st.st_size);
+		return false;
+	}
+	uint64_t used = header->mUsed < (uint64_t) st.st_size ? header->mUsed : st.st_size;
+	const char *base = (const char*) map;
+
+	// Records can precede the description of their site when threads race, so find all the sites first.
+	std::map<uint64_t,DecodedSite> sites;
+	const uint64_t first = (sizeof(BinaryLogHeader) + 7) & ~7;
+	const BinaryLogEntry *entry;
+	for (uint64_t offset = first; (entry = entryAt(base,offset,used)); offset += entry->mLength) {
+		if (entry->mType == BLOG_SITE && !decodeSite(entry,sites[entry->mSite])) {
+			std::cerr << path << ": bad site description at offset " << offset << std::endl;
+		}
+	}
+
+	for (uint64_t offset = first; (entry = entryAt(base,offset,used)); offset += entry->mLength) {
+		if (entry->mType != BLOG_RECORD) continue;
+		std::cout << (entry->mPriority < 8 ? levelNames[entry->mPriority] : "?") << ' ' << header->mPid << ':' << entry->mTid;
+		printTime(std::cout,entry->mTime);
+		std::map<uint64_t,DecodedSite>::const_iterator it = sites.find(entry->mSite);
+		std::vector<const char*> names(entry->mCount,(const char*)NULL);
+		if (it == sites.end()) {
+			std::cout << " (unknown site 0x" << std::hex << entry->mSite << std::dec << "): ";
+		} else {
+			const DecodedSite &site = it->second;
+			std::cout << ' ' << site.mFile << ':' << site.mLine << ':' << site.mFunction << ": ";
+			for (unsigned i = 0; i < entry->mCount && i < site.mNames.size(); i++) {
+				if (site.mNames[i].size()) names[i] = site.mNames[i].c_str();
+			}
+		}
+		const char *args = (const char*) entry + sizeof(BinaryLogEntry);
+		if (!gBinaryLogFormat(std::cout,names.empty() ? NULL : &names[0],entry->mCount,args,entry->mLength - sizeof(BinaryLogEntry))) {
+			std::cout << " (truncated)";
+		}
+		std::cout << "\n";
+	}
+	munmap(map,st.st_size);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		std::cerr << "usage: " << argv[0] << " segment..." << std::endl;
+		return 2;
+	}
+	int status = 0;
+	for (int i = 1; i < argc; i++) {
+		if (!decodeSegment(argv[i])) status = 1;
+	}
+	return status;
+}
+
+// vim: ts=4 sw=4
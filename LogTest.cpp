@@ -26,10 +26,15 @@
 */
 
 #include <iostream>
+#include <fstream>
 #include <iterator>
+#include <signal.h>
+#include <sys/wait.h>
 
 #include "Logger.h"
+#include "BinaryLog.h"
 #include "Configuration.h"
+#include "UnixSignal.h"
 
 ConfigurationTable gConfig;
 //ConfigurationTable gConfig("example.config");
@@ -40,10 +45,21 @@ void printAlarms()
     std::list<std::string> alarms = gGetLoggerAlarms();
     std::cout << "# alarms = " << alarms.size() << std::endl;
     std::copy( alarms.begin(), alarms.end(), output );
+    std::vector<LoggerAlarm> records;
+    unsigned next = gGetLoggerAlarms(records);
+    if (records.size()) {
+        std::cout << "alarm sequence " << records.front().mSequence << ".." << records.back().mSequence
+            << ", next " << next << ", newest from line " << (records.back().mSite ? records.back().mSite->mLine : 0) << std::endl;
+    }
 }
 
 int main(int argc, char *argv[])
 {
+	// "LogTest async" runs the same tests through the async writer thread.
+	if (argc > 1 && std::string(argv[1]) == "async") {
+		gConfig.set("Log.Async","1");
+		gLogToConsole = true;
+	}
 	gLogInit("LogTest","NOTICE",LOG_LOCAL7);
 
 	LOG(EMERG) << " testing the logger.";
@@ -64,6 +80,89 @@ int main(int argc, char *argv[])
     }
     std::cout << "you should see ten lines with the numbers 10..19:" << std::endl;
     printAlarms();
+    std::cout << "----------- changing Log.Level.LogTest.cpp ----------" << std::endl;
+    for (int i = 0; i < 2; i++) {
+        std::cout << "DEBUG enabled: " << IS_LOG_LEVEL(DEBUG) << " (expect " << i << ")" << std::endl;
+        gConfig.set("Log.Level.LogTest.cpp","DEBUG");
+    }
+    std::cout << "----------- log groups ----------" << std::endl;
+    int group = gLogGroup.registerGroup("LogTestGroup");
+    std::cout << "group handle: " << group << " (expect " << LogGroup::_NumberOfLogGroups << ")" << std::endl;
+    for (int i = 0; i < 2; i++) {
+        std::cout << "group DEBUG enabled: " << gCheckGroupLogLevel(group,LOG_DEBUG) << " (expect " << i << ")" << std::endl;
+        gConfig.set("Log.Group.LogTestGroup","DEBUG");
+    }
+    std::cout << "----------- repeats and rate limits ----------" << std::endl;
+    std::cout << "you should see \"the same line\" once, then \"last message repeated 4 times\":" << std::endl;
+    for (int i = 0; i < 6; i++) {
+        LOG(NOTICE) << (i < 5 ? "the same line" : "a different line");
+    }
+    for (int i = 0; i < 100; i++) {
+        LOG_RATELIMITED(NOTICE,1,3) << "rate limited " << i;
+    }
+    gLogFlush();
+    std::cout << "expect 4 and 97 suppressed:" << std::endl;
+    gLogSiteStats(std::cout);
+    std::vector<LoggerAlarm> alarms;
+    unsigned firstAlarm = gGetLoggerAlarms(alarms);
+    for (int i = 0; i < 3; i++) {
+        LOG(CRIT) << "the same alarm";
+    }
+    std::cout << "repeated alarms kept: " << gGetLoggerAlarms(alarms) - firstAlarm << " (expect 3)" << std::endl;
+    std::cout << "----------- sampling ----------" << std::endl;
+    gConfig.set("Log.Sample.LogTest.cpp","10");
+    std::cout << "you should see \"sampled\" 9, 19 and 29:" << std::endl;
+    for (int i = 0; i < 30; i++) {
+        LOG(NOTICE) << "sampled " << i;
+    }
+    gConfig.set("Log.Sample.LogTest.cpp","");
+    gLogFlush();
+    std::cout << "expect sampled=27:" << std::endl;
+    gLogSiteStats(std::cout);
+    std::cout << "----------- flight recorder ----------" << std::endl;
+    gConfig.set("Log.Level.LogTest.cpp","NOTICE");
+    gConfig.set("Log.FlightRecorder","DEBUG");
+    gConfig.set("Log.FlightRecorder.File","/tmp/LogTest.flight");
+    for (int i = 0; i < 10; i++) {
+        LOG_RATELIMITED(DEBUG,1,1) << "recorded, not rate limited";
+    }
+    std::cout << "expect the same sites as above:" << std::endl;
+    gLogSiteStats(std::cout);
+    LOG(DEBUG) << "recorded but not written";
+    gLogFlightRecorderSignal(0);
+    std::cout << "/tmp/LogTest.flight should end with \"recorded but not written\"" << std::endl;
+    // With the flight recorder on, gLogInit registers it with gSigVec, so a crash writes it without any help.
+    std::cout.flush();
+    unlink("/tmp/LogTest.crash.flight");
+    pid_t child = fork();
+    if (child == 0) {
+        freopen("/dev/null","w",stdout);
+        gConfig.set("Log.FlightRecorder.File","/tmp/LogTest.crash.flight");
+        gSigVec.CoreName("/tmp/LogTest.core",true);
+        gLogInit("LogTest","NOTICE",LOG_LOCAL7);
+        LOG(DEBUG) << "recorded before the abort";
+        abort();
+    }
+    int status = 0;
+    waitpid(child,&status,0);
+    std::ifstream flight("/tmp/LogTest.crash.flight");
+    std::string flightText((std::istreambuf_iterator<char>(flight)),std::istreambuf_iterator<char>());
+    std::cout << "child killed by SIGABRT: " << (WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT)
+        << ", flight recorder written: " << (flightText.find("recorded before the abort") != std::string::npos) << " (expect 1, 1)" << std::endl;
+    unlink(format("/tmp/LogTest.core.%d",(int)child).c_str());
+    std::cout << "----------- binary log ----------" << std::endl;
+    gConfig.set("Log.FlightRecorder","");
+    int frame = 42;
+    unsigned flags = 0xbeef;
+    BLOG(NOTICE) << "no segment, written as text" << BLOGVAR(frame) << BLOGHEX(flags);
+    gConfig.set("Log.Binary.File","/tmp/LogTest.blog");
+    gBinaryLogInit();
+    for (int i = 0; i < 3; i++) {
+        BLOG(NOTICE) << "binary" << BLOGVAR(i) << BLOGVAR(frame) << BLOGHEX(flags) << ' ' << 2.5 << std::string(" end");
+    }
+    gBinaryLogClose();
+    std::cout << "\"LogDecode /tmp/LogTest.blog.1\" should print three records" << std::endl;
+    std::cout << "dropped records: " << gLogDroppedCount() << std::endl;
 }
 
 
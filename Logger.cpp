@@ -30,11 +30,23 @@
 #include <fstream>
 #include <string>
 #include <stdarg.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/stat.h>
 
 #include "Configuration.h"
 #include "Timeval.h"
 #include "Logger.h"
+#include "BinaryLog.h"
 #include "Threads.h"	// pat added
+#include "Sockets.h"
+#include "UnixSignal.h"
 
 
 using namespace std;
@@ -43,25 +55,13 @@ using namespace std;
 extern ConfigurationTable gConfig;
 
 
-/**@ The global alarms table. */
-//@{
-Mutex           alarmsLock;
-list<string>    alarmsList;
-void            addAlarm(const string&);
-//@}
-
 // (pat 3-2014) Note that the logger is used by multiple programs.
 pid_t gPid = 0;
 
 
-// (pat) If Log messages are printed before the classes in this module are inited
-// (which happens when static classes have constructors that do work)
-// the OpenBTS just crashes.
-// Prevent that by setting sLoggerInited to true when this module is inited.
-static bool sLoggerInited = 0;
-static struct CheckLoggerInitStatus {
-	CheckLoggerInitStatus() { sLoggerInited = 1; }
-} sCheckloggerInitStatus;
+// (pat) Log messages can be printed before the classes in this module are inited
+// (which happens when static classes have constructors that do work), so everything
+// the LOG path touches, including the alarm ring, is plain static storage that needs no constructor.
 
 
 
@@ -71,7 +71,6 @@ const char *levelNames[] = {
 };
 int numLevels = 8;
 bool gLogToConsole = 0;
-FILE *gLogToFile = NULL;
 Mutex gLogToLock;
 LogGroup gLogGroup;
 
@@ -137,30 +136,156 @@ int getLoggingLevel(const char* filename)
 	return lookupLevel("Log.Level");
 }
 
+// Log.Sample.<file>, else Log.Sample.<group>, else 0 for no sampling.
+static unsigned getSampleRate(const char *filename, const char *groupName)
+{
+	const char *names[2] = { filename, groupName };
+	for (unsigned i = 0; i < 2; i++) {
+		if (names[i] == NULL) continue;
+		string keyName = string("Log.Sample.") + names[i];
+		if (gConfig.defines(keyName)) {
+			string keyVal = gConfig.getStr(keyName);
+			if (keyVal.size()) { return strtoul(keyVal.c_str(),NULL,10); }
+		}
+	}
+	return 0;
+}
+
+
+// Starts at 1 so that a zero-initialized LogSite is always stale.
+volatile int gLogGeneration = 1;
+
+void gLogConfigChanged()
+{
+	int gen = __sync_add_and_fetch(&gLogGeneration,1);
+	if (gen == 0) { __sync_bool_compare_and_swap(&gLogGeneration,0,1); }	// Skip 0 on wraparound.
+}
+
+// Every LogSite that has ever been checked, linked through mNext.
+static LogSite * volatile sLogSites = NULL;
+
+// Logger settings that are re-read from the config whenever gLogGeneration changes.
+static volatile int sLogSettingsGeneration = 0;
+static volatile int sLogFoldWindow = 30;		// Log.FoldRepeats
+static volatile int sFlightLevel = -1;			// Log.FlightRecorder, or -1 if it is off.
+static unsigned sFlightRecords = 0;				// Log.FlightRecorder.Records, fixed once the first ring exists.
+static char sFlightPath[256];					// Log.FlightRecorder.File, ready for the signal handler.
+static volatile unsigned sAlarmsMax = 20;		// Log.Alarms.Max
+
+static void logSettingsRefresh(int gen)
+{
+	if (sLogSettingsGeneration == gen) return;
+	sLogSettingsGeneration = gen;	// First, in case the config lookups below log something.
+	try {
+		sLogFoldWindow = gConfig.getNum("Log.FoldRepeats");
+		sAlarmsMax = gConfig.getNum("Log.Alarms.Max");
+		string flight = gConfig.getStr("Log.FlightRecorder");
+		if (sFlightRecords == 0) { sFlightRecords = gConfig.getNum("Log.FlightRecorder.Records"); }
+		string path = gConfig.getStr("Log.FlightRecorder.File");
+		if (path.empty()) {
+			snprintf(sFlightPath,sizeof(sFlightPath),"/tmp/flightrecorder.%d",(int)getpid());
+		} else {
+			snprintf(sFlightPath,sizeof(sFlightPath),"%s",path.c_str());
+		}
+		sFlightLevel = flight.empty() ? -1 : levelStringToInt(flight);
+	} catch (ConfigurationTableKeyNotFound) {
+		// A key is missing from the table; keep the defaults and try again after the next change.
+		// (Logging before gConfig is constructed is undefined behaviour, not an exception, and this does not cover it.)
+		sLogSettingsGeneration = 0;
+	}
+}
+
+int gLogSiteRefresh(LogSite *site)
+{
+	// Sample the generation first so a change that happens while we are looking up the level is not lost.
+	int gen = gLogGeneration;
+	if (!site->mRegistered && __sync_bool_compare_and_swap(&site->mRegistered,0,1)) {
+		LogSite *head;
+		do {
+			head = sLogSites;
+			site->mNext = head;
+		} while (!__sync_bool_compare_and_swap(&sLogSites,head,site));
+	}
+	logSettingsRefresh(gen);
+	int level = gGetLoggingLevel(site->mFile);
+	if (site->mGroup < 0 && site->mGroupName) { site->mGroup = gLogGroup.registerGroup(site->mGroupName); }
+	if (site->mGroup >= 0 && site->mGroup < gLogGroup.numGroups()) {
+		if (gLogGroup.mGeneration != gen) { gLogGroup.refresh(); }
+		int groupLevel = gLogGroup.mDebugLevel[site->mGroup];
+		if (groupLevel > level) { level = groupLevel; }
+	}
+	site->mSample = getSampleRate(site->mFile,gLogGroup.groupName(site->mGroup));
+	site->mLevel = level;
+	site->mRecordLevel = (sFlightLevel > level) ? sFlightLevel : level;
+	__sync_synchronize();
+	site->mGeneration = gen;
+	return level;
+}
+
+
+LogSite *gLogSiteRateCheck(LogSite *site, unsigned perSecond, unsigned burst)
+{
+	// Token bucket in one 64 bit word so it can be updated with a compare-and-swap:
+	// the high half is the msecs of the last refill, the low half is milli-tokens.
+	// Refilling perSecond tokens per second is perSecond milli-tokens per msec.
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+	uint32_t now = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	uint64_t full = (burst ? burst : 1) * 1000ULL;
+	while (1) {
+		uint64_t old = site->mBucket;
+		uint64_t tokens = old ? (uint32_t)old + (uint64_t)(uint32_t)(now - (uint32_t)(old >> 32)) * perSecond : full;
+		if (tokens > full) tokens = full;
+		bool pass = tokens >= 1000;
+		if (pass) tokens -= 1000;
+		if (__sync_bool_compare_and_swap(&site->mBucket,old,((uint64_t)now << 32) | tokens)) {
+			if (pass) return site;
+			__sync_fetch_and_add(&site->mRateSuppressed,1);
+			__sync_fetch_and_add(&site->mSuppressed,1);
+			return NULL;
+		}
+	}
+}
+
+// The count is kept in the site, so exactly 1 in N records from it is written whichever threads log them.
+LogSite *gLogSiteSample(LogSite *site)
+{
+	unsigned n = site->mSample;
+	if (__sync_add_and_fetch(&site->mSampleCount,1) % n) return NULL;
+	__sync_fetch_and_add(&site->mSampled,n-1);	// The ones skipped to get here.
+	return site;
+}
+
+void gLogSiteStats(std::ostream &os)
+{
+	for (LogSite *site = sLogSites; site; site = site->mNext) {
+		if (site->mSuppressed || site->mSampled) {
+			os << site->mFile << ":" << site->mLine << ":" << site->mFunction << " suppressed=" << site->mSuppressed;
+			if (site->mSampled) { os << " sampled=" << site->mSampled; }
+			os << "\n";
+		}
+	}
+}
+
 
 int gGetLoggingLevel(const char* filename)
 {
-	// This is called a lot and needs to be efficient.
+	// (pat) This used to be called by every LOG(); now it is the slow path behind the LogSite cache.
 
 	static Mutex sLogCacheLock;
-	static map<uint64_t,int>  sLogCache;
-	static unsigned sCacheCount;
-	static const unsigned sCacheRefreshCount = 1000;
+	static HashStringTable<int> sLogCache;
+	static int sCacheGeneration;
 
 	if (filename==NULL) return gGetLoggingLevel("");
 
-	HashString hs(filename);
-	uint64_t key = hs.hash();
-
 	sLogCacheLock.lock();
-	// Time for a cache flush?
-	if (sCacheCount>sCacheRefreshCount) {
+	// Flush the cache if the Log config has changed.
+	if (sCacheGeneration != gLogGeneration) {
 		sLogCache.clear();
-		sCacheCount=0;
+		sCacheGeneration = gLogGeneration;
 	}
 	// Is it cached already?
-	map<uint64_t,int>::const_iterator where = sLogCache.find(key);
-	sCacheCount++;
+	HashStringTable<int>::const_iterator where = sLogCache.find(filename);
 	if (where!=sLogCache.end()) {
 		int retVal = where->second;
 		sLogCacheLock.unlock();
@@ -172,7 +297,7 @@ int gGetLoggingLevel(const char* filename)
 	sLogCacheLock.unlock();
 	int level = getLoggingLevel(filename);
 	sLogCacheLock.lock();
-	sLogCache.insert(pair<uint64_t,int>(key,level));
+	sLogCache[filename] = level;
 	sLogCacheLock.unlock();
 	return level;
 }
@@ -181,68 +306,961 @@ int gGetLoggingLevel(const char* filename)
 
 
 
-// copies the alarm list and returns it. list supposed to be small.
+/**@name The alarm ring.
+	The most recent alarms are kept in a fixed ring, big enough for the largest Log.Alarms.Max.
+	A writer claims alarm number N with an atomic increment of sAlarmCount and owns slot N % sAlarmSlots
+	while the slot sequence is odd; the slot sequence is 2N+2 once alarm N is complete.
+	Readers copy a slot and keep it only if the sequence was 2N+2 both before and after the copy,
+	so a snapshot never takes a lock or looks at the config, and never contains a half written alarm.
+*/
+//@{
+static const unsigned sAlarmSlots = 32;		// Power of two, at least the maximum of Log.Alarms.Max.
+
+struct AlarmSlot {
+	volatile unsigned mSeq;
+	struct timeval mTime;
+	int mPriority;
+	const LogSite *mSite;
+	unsigned mLength;
+	char mText[480];			// Longer alarms are truncated.
+};
+
+static AlarmSlot sAlarms[sAlarmSlots];
+static volatile unsigned sAlarmCount = 0;		// Alarms ever claimed.
+
+static void alarmAdd(int priority, const LogSite *site, const char *text, unsigned len)
+{
+	unsigned n = __sync_fetch_and_add(&sAlarmCount,1);
+	AlarmSlot *slot = &sAlarms[n % sAlarmSlots];
+	while (1) {
+		unsigned seq = slot->mSeq;
+		if ((int)(seq - 2*n) > 0) return;		// A newer alarm has already taken the slot.
+		if (seq & 1) { sched_yield(); continue; }	// The alarm a lap ago is still being written.
+		if (__sync_bool_compare_and_swap(&slot->mSeq,seq,2*n+1)) break;
+	}
+	gettimeofday(&slot->mTime,NULL);
+	slot->mPriority = priority;
+	slot->mSite = site;
+	if (len > sizeof(slot->mText)) { len = sizeof(slot->mText); }
+	memcpy(slot->mText,text,len);
+	slot->mLength = len;
+	__sync_synchronize();
+	slot->mSeq = 2*n+2;
+}
+
+unsigned gGetLoggerAlarms(vector<LoggerAlarm> &alarms)
+{
+	logSettingsRefresh(gLogGeneration);
+	unsigned count = sAlarmCount;
+	unsigned want = sAlarmsMax;
+	if (want > sAlarmSlots) { want = sAlarmSlots; }
+	if (want > count) { want = count; }
+	alarms.clear();
+	alarms.reserve(want);
+	for (unsigned n = count - want; n != count; n++) {
+		const AlarmSlot *slot = &sAlarms[n % sAlarmSlots];
+		if (slot->mSeq != 2*n+2) continue;		// Not finished yet, or already overwritten.
+		__sync_synchronize();
+		LoggerAlarm alarm;
+		alarm.mSequence = n;
+		alarm.mTime = slot->mTime;
+		alarm.mPriority = slot->mPriority;
+		alarm.mSite = slot->mSite;
+		alarm.mText.assign(slot->mText,slot->mLength < sizeof(slot->mText) ? slot->mLength : sizeof(slot->mText));
+		__sync_synchronize();
+		if (slot->mSeq != 2*n+2) continue;
+		alarms.push_back(alarm);
+	}
+	return count;
+}
+
 list<string> gGetLoggerAlarms()
 {
-    alarmsLock.lock();
-    list<string> ret;
-    // excuse the "complexity", but to use std::copy with a list you need
-    // an insert_iterator - copy technically overwrites, doesn't insert.
-    insert_iterator< list<string> > ii(ret, ret.begin());
-    copy(alarmsList.begin(), alarmsList.end(), ii);
-    alarmsLock.unlock();
-    return ret;
+	vector<LoggerAlarm> alarms;
+	gGetLoggerAlarms(alarms);
+	list<string> ret;
+	for (vector<LoggerAlarm>::const_iterator it = alarms.begin(); it != alarms.end(); it++) { ret.push_back(it->mText); }
+	return ret;
 }
+//@}
+
+
+// The date and time part of the timestamp only changes once a second, so each thread keeps
+// the formatted prefix for the current second and just patches the tenths digit.
+// The localtime_r and formatting happen at most once per second per thread.
+struct LogTimestampCache {
+	time_t mSecond;
+	unsigned mLength;
+	char mText[32];		// " YYYY-MM-DDTHH:MM:SS.t"
+};
+static __thread LogTimestampCache tLogTimestamp;
 
-/** Add an alarm to the alarm list. */
-void addAlarm(const string& s)
+const char *gLogTimestamp()
 {
-    alarmsLock.lock();
-    alarmsList.push_back(s);
-	unsigned maxAlarms = gConfig.getNum("Log.Alarms.Max");
-    while (alarmsList.size() > maxAlarms) alarmsList.pop_front();
-    alarmsLock.unlock();
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	LogTimestampCache *tc = &tLogTimestamp;
+	if (tc->mLength == 0 || tv.tv_sec != tc->mSecond) {
+		struct tm tm;
+		localtime_r(&tv.tv_sec,&tm);
+		// ISO time but with a fractional seconds number
+		tc->mLength = snprintf(tc->mText,sizeof(tc->mText)," %04d-%02d-%02dT%02d:%02d:%02d.0",
+			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+			tm.tm_hour, tm.tm_min, tm.tm_sec);
+		tc->mSecond = tv.tv_sec;
+	}
+	tc->mText[tc->mLength-1] = '0' + (tv.tv_usec / 100000);	// Rounding down is ok.
+	return tc->mText;
 }
 
 
-Log::~Log()
+// Write one finished record to syslog, the console and the log file.
+// This is the only place the sinks are touched; it runs either on the calling thread
+// or, in async mode, on the log writer thread.
+// Write all of text, or give up on the first error.  Only write() is used, so this is safe in a signal handler.
+static void logWriteAll(int fd, const char *text, unsigned len)
 {
-	if (mDummyInit) return;
-	// Anything at or above LOG_CRIT is an "alarm".
-	// Save alarms in the local list and echo them to stderr.
-	if (mPriority <= LOG_CRIT) {
-		if (sLoggerInited) addAlarm(mStream.str().c_str());
-		cerr << mStream.str() << endl;
+	while (len) {
+		ssize_t n = ::write(fd,text,len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return;
+		text += n;
+		len -= n;
+	}
+}
+
+/**
+	The Log.File sink.
+	Records are gathered in a buffer and written with one write(2) per batch instead of an fputs and fflush per record.
+	With Log.Async the writer thread writes the buffer when it fills, or once the oldest record in it is Log.File.FlushPeriod msecs old;
+	without it there is no thread to come back later, so every record is written as it comes.
+	If a write fails, eg because the disk is full, the records in the buffer are lost and logging carries on.
+	The file is rotated to .1, .2, ... Log.File.Keep when it reaches Log.File.MaxSize bytes or is Log.File.RotatePeriod seconds old, and on every start.
+	This is a POD so it can be used before constructors have run.  Caller holds gLogToLock.
+*/
+class LogFile {
+	static const unsigned sBufferSize = 1<<16;
+	bool mOpen;
+	int mFd;
+	uint64_t mLength;			// Bytes written or buffered.
+	time_t mOpened;
+	uint64_t mBufferedAt;		// msecs when the oldest record in mBuffer was added.
+	uint64_t mMaxSize;
+	unsigned mRotatePeriod;
+	unsigned mKeep;
+	unsigned mFlushPeriod;
+	char mPath[256];
+	volatile unsigned mUsed;	// Bytes in mBuffer.
+	char mBuffer[sBufferSize];
+
+	static uint64_t msecs() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+		return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+	}
+
+	string rotatedName(unsigned n) const {
+		char suffix[16];
+		snprintf(suffix,sizeof(suffix),".%u",n);
+		return string(mPath) + suffix;
+	}
+
+	// Shift path.N to path.N+1, drop the ones beyond mKeep and move the current file to path.1.
+	void shiftFiles() {
+		unlink(rotatedName(mKeep).c_str());
+		for (unsigned n = mKeep; n > 1; n--) { rename(rotatedName(n-1).c_str(),rotatedName(n).c_str()); }
+		if (mKeep) { rename(mPath,rotatedName(1).c_str()); } else { unlink(mPath); }
+	}
+
+	bool openFile() {
+		mFd = ::open(mPath,O_WRONLY|O_CREAT|O_TRUNC|O_APPEND,0644);
+		if (mFd < 0) return false;
+		mLength = 0;
+		mUsed = 0;
+		mOpened = time(NULL);
+		mOpen = true;
+		char line[80];
+		string when = Timeval::isoTime(mOpened,true);
+		append(line,snprintf(line,sizeof(line),"Starting at %s\n",when.c_str()));
+		flush();
+		return true;
+	}
+
+	void append(const char *text, unsigned len) {
+		if (mUsed + len > sBufferSize) {
+			flush();
+			if (len > sBufferSize) {
+				logWriteAll(mFd,text,len);
+				mLength += len;
+				return;
+			}
+		}
+		if (mUsed == 0) { mBufferedAt = msecs(); }
+		memcpy(mBuffer + mUsed,text,len);
+		mUsed += len;
+		mLength += len;
+	}
+
+	public:
+	bool isOpen() const { return mOpen; }
+
+	bool open(const char *path) {
+		if (mOpen) return true;
+		snprintf(mPath,sizeof(mPath),"%s",path);
+		mMaxSize = gConfig.getNum("Log.File.MaxSize");
+		mRotatePeriod = gConfig.getNum("Log.File.RotatePeriod");
+		mKeep = gConfig.getNum("Log.File.Keep");
+		mFlushPeriod = gConfig.getNum("Log.File.FlushPeriod");
+		// Keep the log of the previous run instead of truncating it.
+		struct stat st;
+		if (stat(mPath,&st) == 0 && st.st_size > 0) { shiftFiles(); }
+		return openFile();
+	}
+
+	// If batched the record may stay in the buffer until flushIfDue() or flush().
+	void write(const char *text, unsigned len, bool newline, bool batched) {
+		if (!mOpen) return;
+		append(text,len);
+		if (newline) { append("\n",1); }
+		if ((mMaxSize && mLength >= mMaxSize) || (mRotatePeriod && time(NULL) - mOpened >= (time_t)mRotatePeriod)) {
+			close();
+			shiftFiles();
+			openFile();
+		} else if (!batched) {
+			flush();
+		}
+	}
+
+	void flush() {
+		if (!mOpen || mUsed == 0) return;
+		logWriteAll(mFd,mBuffer,mUsed);
+		mUsed = 0;
+	}
+
+	void flushIfDue() {
+		if (mUsed && msecs() - mBufferedAt >= mFlushPeriod) { flush(); }
+	}
+
+	// For a crash: write what is buffered without the lock, which the crashed thread may hold.
+	void crashFlush() {
+		unsigned used = mUsed;
+		if (!mOpen || used > sBufferSize) return;
+		logWriteAll(mFd,mBuffer,used);
+		mUsed = 0;
+	}
+
+	// For a crash: write a record straight to the file, without the lock or the buffer.
+	void crashWrite(const char *text, unsigned len) {
+		if (!mOpen) return;
+		logWriteAll(mFd,text,len);
+		if (len == 0 || text[len-1] != '\n') { logWriteAll(mFd,"\n",1); }
+	}
+
+	void close() {
+		if (!mOpen) return;
+		flush();
+		mOpen = false;
+		::close(mFd);
+	}
+};
+static LogFile sLogFile;
+
+static void logFileClose()
+{
+	ScopedLock lock(gLogToLock);
+	sLogFile.close();
+}
+
+static void logFileOpen(const char *name, const char *path)
+{
+	ScopedLock lock(gLogToLock);
+	if (sLogFile.isOpen()) return;
+	if (sLogFile.open(path)) {
+		atexit(logFileClose);
+		std::cerr << name <<" logging to file: " << path << "\n";
+	} else {
+		std::cerr << name <<" cannot log to file: " << path << ": " << strerror(errno) << "\n";
+	}
+}
+
+/**
+	The Log.Syslog.Direct sink.
+	glibc syslog() takes a lock and does a sendto per record; this formats RFC 3164 frames itself
+	and sends a batch of them to the syslog socket with one sendmmsg.  The async writer flushes once per batch.
+	The socket is non-blocking: if syslogd cannot keep up, or is not there, the records are counted and dropped.
+	After an error the socket is reopened, at most once a second, which covers a restart of syslogd.
+*/
+class LogSyslogSink {
+	static const unsigned sMaxBatch = 32;
+	static const unsigned sMaxFrame = 2048;
+	Mutex mLock;
+	UDDSocket *mSocket;
+	string mPath;
+	string mIdent;
+	int mFacility;
+	time_t mRetryAt;
+	time_t mStampSecond;
+	char mStamp[20];			// "Mmm dd hh:mm:ss" for mStampSecond.
+	unsigned mCount;
+	struct iovec mFrames[sMaxBatch];
+	char mBuffer[sMaxBatch][sMaxFrame];
+
+	void reopen() {
+		delete mSocket;
+		mSocket = NULL;
+		try {
+			mSocket = new UDDSocket();
+			mSocket->open(NULL);
+			mSocket->destination(mPath.c_str());
+		} catch (SocketError) {
+			delete mSocket;
+			mSocket = NULL;
+		}
+	}
+
+	void sendLocked() {
+		unsigned sent = 0;
+		time_t now = time(NULL);
+		if (mSocket == NULL && now >= mRetryAt) { reopen(); }
+		if (mSocket) {
+			int n = mSocket->writeBatch(mFrames,mCount);
+			if (n < 0 && now >= mRetryAt) {
+				// Perhaps syslogd restarted; try once with a new socket.
+				reopen();
+				n = mSocket ? mSocket->writeBatch(mFrames,mCount) : -1;
+			}
+			if (n < 0) {
+				mRetryAt = now + 1;
+				delete mSocket;
+				mSocket = NULL;
+			} else {
+				sent = n;		// The rest would have blocked.
+			}
+		}
+		if (sent < mCount) { __sync_fetch_and_add(&mDropped,mCount - sent); }
+		mCount = 0;
+	}
+
+	public:
+	volatile unsigned long mDropped;
+
+	LogSyslogSink(const char *path, const char *ident, int facility)
+		:mSocket(NULL), mPath(path), mIdent(ident), mFacility(facility), mRetryAt(0), mStampSecond(0), mCount(0), mDropped(0)
+	{ }
+
+	void add(int priority, const char *text, unsigned len) {
+		ScopedLock lock(mLock);
+		time_t now = time(NULL);
+		if (now != mStampSecond) {
+			struct tm tm;
+			localtime_r(&now,&tm);
+			strftime(mStamp,sizeof(mStamp),"%b %e %H:%M:%S",&tm);
+			mStampSecond = now;
+		}
+		char *frame = mBuffer[mCount];
+		int n = snprintf(frame,sMaxFrame,"<%d>%s %s[%d]: %.*s",mFacility|priority,mStamp,mIdent.c_str(),(int)getpid(),(int)len,text);
+		mFrames[mCount].iov_base = frame;
+		mFrames[mCount].iov_len = (n < 0) ? 0 : ((unsigned)n < sMaxFrame) ? n : sMaxFrame-1;
+		if (++mCount == sMaxBatch) { sendLocked(); }
+	}
+
+	void flush() {
+		ScopedLock lock(mLock);
+		if (mCount) { sendLocked(); }
+	}
+};
+static LogSyslogSink *sSyslogSink = NULL;
+// Set while a thread is in the syslog sink, so a record logged from inside it (eg, by SocketError) goes to syslog().
+static __thread bool tInSyslogSink = false;
+
+static void logSyslogStart(const char *name, int facility)
+{
+	openlog(name,0,facility);
+	if (sSyslogSink == NULL && gConfig.getBool("Log.Syslog.Direct")) {
+		sSyslogSink = new LogSyslogSink(gConfig.getStr("Log.Syslog.Path").c_str(),name,facility);
+	}
+}
+
+unsigned long gLogSyslogDroppedCount() { return sSyslogSink ? sSyslogSink->mDropped : 0; }
+
+// Send the records held by the syslog sink, and those held by Log.File if all or if Log.File.FlushPeriod is up.
+static void logFlushSinks(bool all)
+{
+	if (sSyslogSink && !tInSyslogSink) {
+		tInSyslogSink = true;
+		sSyslogSink->flush();
+		tInSyslogSink = false;
+	}
+	if (sLogFile.isOpen()) {
+		ScopedLock lock(gLogToLock);
+		if (all) { sLogFile.flush(); } else { sLogFile.flushIfDue(); }
+	}
+}
+
+// Write a record to syslog, the console and Log.File.
+// If batched the syslog sink and Log.File may hold on to it until logFlushSinks().
+static void logWriteSinks(int priority, const char *text, unsigned len, bool batched = false)
+{
+	if (sSyslogSink && !tInSyslogSink) {
+		tInSyslogSink = true;
+		sSyslogSink->add(priority,text,len);
+		if (!batched) { sSyslogSink->flush(); }
+		tInSyslogSink = false;
+	} else {
+		syslog(priority, "%.*s", (int)len, text);
 	}
-	// Current logging level was already checked by the macro.
-	// So just log.
-	syslog(mPriority, "%s", mStream.str().c_str());
 	// pat added for easy debugging.
-	if (gLogToConsole||gLogToFile) {
-		int mlen = mStream.str().size();
-		int neednl = (mlen==0 || mStream.str()[mlen-1] != '\n');
+	if (gLogToConsole||sLogFile.isOpen()) {
+		int neednl = (len==0 || text[len-1] != '\n');
 		gLogToLock.lock();
 		if (gLogToConsole) {
 			// The COUT() macro prevents messages from stomping each other but adds uninteresting thread numbers,
-			// so just use std::cout.
-			std::cerr << mStream.str();
+			// so just use std::cerr.
+			std::cerr.write(text,len);
 			if (neednl) std::cerr<<"\n";
 		}
-		if (gLogToFile) {
-			fputs(mStream.str().c_str(),gLogToFile);
-			if (neednl) {fputc('\n',gLogToFile);}
-			fflush(gLogToFile);
+		if (sLogFile.isOpen()) {
+			sLogFile.write(text,len,neednl,batched);
 		}
 		gLogToLock.unlock();
 	}
 }
 
+// Write a record from a crash, with nothing but write(2) to descriptors that are already open: no locks and no stdio.
+// syslog() is not safe here either, so if there is no Log.File the record goes to stderr whether or not gLogToConsole is set.
+static void logCrashWrite(const char *text, unsigned len)
+{
+	if (sLogFile.isOpen()) { sLogFile.crashWrite(text,len); }
+	if (gLogToConsole || !sLogFile.isOpen()) {
+		logWriteAll(2,text,len);
+		if (len == 0 || text[len-1] != '\n') { logWriteAll(2,"\n",1); }
+	}
+}
+
+
+/**@name Asynchronous logging.
+	When Log.Async is set ~Log only copies the finished record into a bounded lock-free ring
+	and a dedicated writer thread hands the records to the sinks in batches.
+	The ring is Dmitry Vyukov's bounded queue: each slot carries a sequence number,
+	so producers claim a slot with a single compare-and-swap and never take a lock.
+*/
+//@{
+static const unsigned sLogRecordMax = 512;		// Longer records bypass the ring and are written synchronously.
+
+struct LogRecordSlot {
+	volatile unsigned mSeq;
+	int mPriority;
+	unsigned mLength;
+	char mText[sLogRecordMax];
+};
+
+class LogAsyncQueue {
+	LogRecordSlot *mSlots;
+	unsigned mMask;
+	volatile unsigned mEnqueuePos;
+	unsigned mDequeuePos;		// Only touched by whoever owns mConsumer.
+	volatile int mConsumer;		// Set while one thread is draining the ring.
+
+	public:
+	LogAsyncQueue(unsigned size) : mEnqueuePos(0), mDequeuePos(0), mConsumer(0) {
+		unsigned n = 1;
+		while (n < size) { n <<= 1; }		// Must be a power of two.
+		mMask = n - 1;
+		mSlots = new LogRecordSlot[n];
+		for (unsigned i = 0; i < n; i++) { mSlots[i].mSeq = i; }
+	}
+
+	// Return false if the ring is full.
+	bool push(int priority, const char *text, unsigned len) {
+		unsigned pos = mEnqueuePos;
+		LogRecordSlot *slot;
+		while (1) {
+			slot = &mSlots[pos & mMask];
+			int dif = (int)(slot->mSeq - pos);
+			if (dif == 0) {
+				if (__sync_bool_compare_and_swap(&mEnqueuePos,pos,pos+1)) break;
+				pos = mEnqueuePos;
+			} else if (dif < 0) {
+				return false;	// full
+			} else {
+				pos = mEnqueuePos;
+			}
+		}
+		slot->mPriority = priority;
+		slot->mLength = len;
+		memcpy(slot->mText,text,len);
+		__sync_synchronize();
+		slot->mSeq = pos + 1;
+		return true;
+	}
+
+	bool claimConsumer() { return __sync_bool_compare_and_swap(&mConsumer,0,1); }
+	void releaseConsumer() { __sync_synchronize(); mConsumer = 0; }
+
+	// Caller must own the consumer.  Returns the number of records written.
+	unsigned drain(unsigned maxRecords) {
+		unsigned cnt = 0;
+		for (; cnt < maxRecords; cnt++) {
+			LogRecordSlot *slot = &mSlots[mDequeuePos & mMask];
+			if ((int)(slot->mSeq - (mDequeuePos+1)) < 0) break;	// empty
+			__sync_synchronize();
+			logWriteSinks(slot->mPriority,slot->mText,slot->mLength,true);
+			__sync_synchronize();
+			slot->mSeq = mDequeuePos + mMask + 1;
+			mDequeuePos++;
+		}
+		if (cnt) { logFlushSinks(false); }
+		return cnt;
+	}
+
+	// Like drain, but for a crash: everything left goes to logCrashWrite.
+	void crashDrain() {
+		while (1) {
+			LogRecordSlot *slot = &mSlots[mDequeuePos & mMask];
+			if ((int)(slot->mSeq - (mDequeuePos+1)) < 0) break;	// empty
+			__sync_synchronize();
+			logCrashWrite(slot->mText,slot->mLength < sLogRecordMax ? slot->mLength : sLogRecordMax);
+			slot->mSeq = mDequeuePos + mMask + 1;
+			mDequeuePos++;
+		}
+	}
+};
+
+static LogAsyncQueue *sLogQueue = NULL;
+static Thread *sLogWriterThread = NULL;
+static sem_t sLogWakeup;
+static volatile int sLogWriterSleeping = 0;
+static volatile int sLogWriterStop = 0;
+static volatile unsigned long sLogDropped = 0;
+static bool sLogOverflowDrop = true;	// Log.Async.Overflow: drop the record, or write it on the caller's thread.
+
+static void logFoldSummaries();
+
+static void *logWriterThread(void *)
+{
+	unsigned long reportedDrops = 0;
+	while (!sLogWriterStop) {
+		unsigned cnt = 0;
+		if (sLogQueue->claimConsumer()) {
+			cnt = sLogQueue->drain(256);
+			sLogQueue->releaseConsumer();
+		}
+		if (sLogDropped != reportedDrops) {
+			unsigned long dropped = sLogDropped;
+			char buf[100];
+			int len = snprintf(buf,sizeof(buf),"WARNING %d:%lu log queue overflow, %lu records dropped",
+				gPid,(unsigned long)gettid(),dropped - reportedDrops);
+			logWriteSinks(LOG_WARNING,buf,len);
+			reportedDrops = dropped;
+		}
+		logFoldSummaries();
+		if (cnt) continue;
+		logFlushSinks(false);	// The Log.File.FlushPeriod timer.
+		// Nothing to do.  Producers only post the semaphore when we advertise that we are asleep,
+		// so a busy writer costs them nothing but the ring insert.
+		sLogWriterSleeping = 1;
+		__sync_synchronize();
+		if (sLogQueue->claimConsumer()) {	// Recheck after advertising, to close the race with a producer.
+			cnt = sLogQueue->drain(256);
+			sLogQueue->releaseConsumer();
+		}
+		if (cnt == 0) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME,&ts);
+			ts.tv_nsec += 100*1000*1000;
+			if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+			sem_timedwait(&sLogWakeup,&ts);
+		}
+		sLogWriterSleeping = 0;
+	}
+	return NULL;
+}
+
+// Called at exit: stop the writer and write whatever it left behind.
+static void logAsyncShutdown()
+{
+	if (!sLogQueue || !sLogWriterThread) return;
+	sLogWriterStop = 1;
+	sem_post(&sLogWakeup);
+	sLogWriterThread->join();
+	gLogFlush();
+}
+
+static void logAsyncStart(unsigned queueSize, bool dropOnOverflow)
+{
+	if (sLogQueue) return;	// Already running.
+	sLogOverflowDrop = dropOnOverflow;
+	sem_init(&sLogWakeup,0,0);
+	LogAsyncQueue *queue = new LogAsyncQueue(queueSize);
+	sLogWriterThread = new Thread();
+	__sync_synchronize();
+	sLogQueue = queue;
+	sLogWriterThread->start(logWriterThread,NULL);
+	atexit(logAsyncShutdown);
+}
+
+// Hand a finished record to the sinks, through the ring if async logging is on.
+static void logWriteRecord(int priority, const char *text, unsigned len)
+{
+	LogAsyncQueue *queue = sLogQueue;
+	if (queue && len <= sLogRecordMax && !sLogWriterStop) {
+		if (queue->push(priority,text,len)) {
+			if (sLogWriterSleeping) { sem_post(&sLogWakeup); }
+			return;
+		}
+		// Overflow.  Alarms are never dropped.
+		if (sLogOverflowDrop && priority > LOG_CRIT) {
+			__sync_fetch_and_add(&sLogDropped,1);
+			return;
+		}
+	}
+	logWriteSinks(priority,text,len);
+}
+
+void gLogFlush()
+{
+	if (!sLogQueue) return;
+	// Wait briefly for the writer to finish its batch.
+	for (int tries = 0; !sLogQueue->claimConsumer(); tries++) {
+		if (tries > 1000) return;
+		usleep(100);
+	}
+	while (sLogQueue->drain(1000)) { continue; }
+	logFlushSinks(true);
+	sLogQueue->releaseConsumer();
+}
+
+void gLogCrashFlush(int /*sig*/)
+{
+	if (!sLogQueue) return;
+	sLogWriterStop = 1;		// Anything logged from here on is written synchronously.
+	// Give the writer 100ms to finish its batch.  It may be the thread that crashed, in which case it never
+	// releases the ring; take it anyway.  poll() is the sleep that is safe in a signal handler.
+	for (int tries = 0; tries < 100 && !sLogQueue->claimConsumer(); tries++) {
+		poll(NULL,0,1);
+	}
+	sLogFile.crashFlush();
+	sLogQueue->crashDrain();
+}
+
+unsigned long gLogDroppedCount() { return sLogDropped; }
+//@}
+
+
+/**@name The crash flight recorder. */
+//@{
+// Each thread keeps its most recent records, down to Log.FlightRecorder, in a ring of fixed size slots.
+// The slot holds the time, level and LogSite in binary and only the body of the record as text;
+// the header is formatted when the ring is dumped, and records below the logging level never get one.
+struct FlightSlot {
+	struct timeval mTime;
+	const LogSite *mSite;		// NULL for _LOG records, whose text includes the header.
+	short mPriority;
+	unsigned short mLength;
+	char mText[232];
+};
+
+struct FlightRing {
+	FlightRing *mNext;
+	volatile int mInUse;		// Owned by a live thread.
+	pid_t mTid;
+	volatile unsigned mCount;	// Records ever written; the next one goes in mSlots[mCount % mSize].
+	unsigned mSize;
+	FlightSlot mSlots[1];		// Really mSize of them.
+};
+
+// Every ring ever allocated.  Rings are never freed, because the signal handler walks this list;
+// instead the ring of an exiting thread is reused by the next new thread.
+static FlightRing * volatile sFlightRings = NULL;
+static __thread FlightRing *tFlightRing = NULL;
+static pthread_key_t sFlightKey;
+static pthread_once_t sFlightKeyOnce = PTHREAD_ONCE_INIT;
+
+static void flightRingRelease(void *arg)
+{
+	__sync_synchronize();
+	((FlightRing*)arg)->mInUse = 0;
+}
+
+static void flightKeyCreate() { pthread_key_create(&sFlightKey,flightRingRelease); }
+
+static FlightRing *flightRing()
+{
+	if (tFlightRing) return tFlightRing;
+	FlightRing *ring;
+	for (ring = sFlightRings; ring; ring = ring->mNext) {
+		if (!ring->mInUse && __sync_bool_compare_and_swap(&ring->mInUse,0,1)) break;
+	}
+	if (ring == NULL) {
+		unsigned size = sFlightRecords ? sFlightRecords : 256;
+		ring = (FlightRing*) calloc(1,sizeof(FlightRing) + (size-1) * sizeof(FlightSlot));
+		if (ring == NULL) return NULL;
+		ring->mSize = size;
+		ring->mInUse = 1;
+		FlightRing *head;
+		do {
+			head = sFlightRings;
+			ring->mNext = head;
+		} while (!__sync_bool_compare_and_swap(&sFlightRings,head,ring));
+	}
+	ring->mTid = gettid();
+	ring->mCount = 0;
+	pthread_once(&sFlightKeyOnce,flightKeyCreate);
+	pthread_setspecific(sFlightKey,ring);
+	tFlightRing = ring;
+	return ring;
+}
+
+static void flightRecord(int priority, const LogSite *site, const char *text, unsigned len)
+{
+	FlightRing *ring = flightRing();
+	if (ring == NULL) return;
+	FlightSlot *slot = &ring->mSlots[ring->mCount % ring->mSize];
+	gettimeofday(&slot->mTime,NULL);
+	slot->mSite = site;
+	slot->mPriority = priority;
+	if (len > sizeof(slot->mText)) { len = sizeof(slot->mText); }
+	memcpy(slot->mText,text,len);
+	slot->mLength = len;
+	__sync_synchronize();
+	ring->mCount++;
+}
+
+// Buffered output to a file descriptor with nothing but write(), for use in a signal handler.
+class FlightWriter {
+	int mFd;
+	unsigned mLength;
+	char mBuffer[4096];
+
+	public:
+	FlightWriter(int fd) : mFd(fd), mLength(0) { }
+	~FlightWriter() { flush(); }
+	void flush() {
+		for (unsigned done = 0; done < mLength; ) {
+			ssize_t n = write(mFd,mBuffer+done,mLength-done);
+			if (n <= 0) break;
+			done += n;
+		}
+		mLength = 0;
+	}
+	void put(const char *text, unsigned len) {
+		while (len) {
+			if (mLength == sizeof(mBuffer)) { flush(); }
+			unsigned n = sizeof(mBuffer) - mLength;
+			if (n > len) { n = len; }
+			memcpy(mBuffer+mLength,text,n);
+			mLength += n;
+			text += n;
+			len -= n;
+		}
+	}
+	void put(const char *text) { put(text,strlen(text)); }
+	void put(unsigned long val, unsigned width = 1) {
+		char digits[24];
+		unsigned n = 0;
+		do { digits[sizeof(digits) - ++n] = '0' + val % 10; val /= 10; } while (val || n < width);
+		put(digits + sizeof(digits) - n,n);
+	}
+};
+
+void gLogFlightRecorderSignal(int sig)
+{
+	if (sFlightRings == NULL || sFlightPath[0] == 0) return;
+	int fd = open(sFlightPath,O_WRONLY|O_CREAT|O_APPEND,0644);
+	if (fd < 0) return;
+	{
+		FlightWriter out(fd);
+		out.put("flight recorder of pid ");
+		out.put(getpid());
+		out.put(" on signal ");
+		out.put(sig);
+		out.put("\n");
+		for (FlightRing *ring = sFlightRings; ring; ring = ring->mNext) {
+			unsigned count = ring->mCount;
+			if (count == 0) continue;
+			out.put("thread ");
+			out.put(ring->mTid);
+			out.put("\n");
+			unsigned n = (count < ring->mSize) ? count : ring->mSize;
+			for (unsigned i = count - n; i != count; i++) {
+				const FlightSlot *slot = &ring->mSlots[i % ring->mSize];
+				// Seconds since the epoch, since localtime is not safe here.
+				out.put(slot->mTime.tv_sec);
+				out.put(".",1);
+				out.put(slot->mTime.tv_usec,6);
+				out.put(" ",1);
+				if (slot->mSite) {
+					out.put(levelNames[slot->mPriority]);
+					out.put(" ",1);
+					out.put(slot->mSite->mFile);
+					out.put(":",1);
+					out.put(slot->mSite->mLine);
+					out.put(":",1);
+					out.put(slot->mSite->mFunction);
+					out.put(": ",2);
+				}
+				out.put(slot->mText,slot->mLength);
+				out.put("\n",1);
+			}
+		}
+	}
+	close(fd);
+}
+//@}
+
+
+/**@name The per-thread log record buffer used by LogStreamBuf. */
+//@{
+static const unsigned sLogBufferSize = 2048;
+static __thread char tLogBuffer[sLogBufferSize];
+static __thread bool tLogBufferBusy;
+//@}
+
+LogStreamBuf::~LogStreamBuf()
+{
+	if (mHeap) free(pbase());
+	if (mThreadBuffer) tLogBufferBusy = false;
+}
+
+void LogStreamBuf::grow(size_t needed)
+{
+	size_t used = size();
+	if (!pbase() && !tLogBufferBusy && needed <= sLogBufferSize) {
+		tLogBufferBusy = true;
+		mThreadBuffer = true;
+		setp(tLogBuffer,tLogBuffer+sLogBufferSize);
+		return;
+	}
+	// Spill to the heap.
+	size_t capacity = epptr() - pbase();
+	if (capacity < 256) capacity = 256;
+	while (capacity < used + needed) capacity *= 2;
+	char *heap = (char*)malloc(capacity);
+	if (used) memcpy(heap,pbase(),used);
+	if (mHeap) free(pbase());
+	mHeap = true;
+	setp(heap,heap+capacity);
+	pbump(used);
+}
+
+LogStreamBuf::int_type LogStreamBuf::overflow(int_type c)
+{
+	if (c == traits_type::eof()) return traits_type::not_eof(c);
+	grow(1);
+	*pptr() = traits_type::to_char_type(c);
+	pbump(1);
+	return c;
+}
+
+std::streamsize LogStreamBuf::xsputn(const char *s, std::streamsize n)
+{
+	if (epptr() - pptr() < n) grow(n);
+	memcpy(pptr(),s,n);
+	pbump(n);
+	return n;
+}
+
+
+// The header that LOG() puts on a record: level, pid:tid, time, file:line:function.
+static unsigned logSiteHeader(char *buf, unsigned size, int priority, const LogSite *site)
+{
+	int n = snprintf(buf,size,"%s %d:%ld%s %s:%u:%s: ",levelNames[priority],(int)gPid,(long)gettid(),
+		gLogTimestamp(),site->mFile,site->mLine,site->mFunction);
+	return (n < 0) ? 0 : ((unsigned)n < size) ? n : size-1;
+}
+
+// Write a one-line report about suppressed records on behalf of a call site.
+static void logSiteSummary(int priority, const LogSite *site, const char *what, unsigned count)
+{
+	char buf[400];
+	unsigned n = logSiteHeader(buf,sizeof(buf)-50,priority,site);
+	n += snprintf(buf+n,50,what,count);
+	logWriteRecord(priority,buf,n);
+}
+
+// FNV-1a, to recognize repeated records.
+static uint32_t logHash(const char *text, unsigned len)
+{
+	uint32_t hash = 2166136261u;
+	for (unsigned i = 0; i < len; i++) { hash = (hash ^ (unsigned char)text[i]) * 16777619u; }
+	return hash;
+}
+
+// Return true if the record is a repeat of the previous one from the same call site and should be folded.
+// Identical records are counted instead of written, and the count comes out as "last message repeated N times"
+// when the site says something different, or, with Log.Async, from the writer thread once Log.FoldRepeats seconds have passed.
+bool Log::fold(const char *record, unsigned len)
+{
+	int window = sLogFoldWindow;
+	if (window <= 0) return false;
+	uint32_t hash = logHash(record+mBodyOffset,len-mBodyOffset);
+	time_t now = time(NULL);
+	if (hash == mSite->mLastHash && now - mSite->mLastTime < window) {
+		__sync_fetch_and_add(&mSite->mRepeats,1);
+		__sync_fetch_and_add(&mSite->mSuppressed,1);
+		return true;
+	}
+	// The summary goes out at the level of the records it stands for, which need not be this one's.
+	if (unsigned repeats = __sync_lock_test_and_set(&mSite->mRepeats,0)) {
+		logSiteSummary(mSite->mLastPriority,mSite,"last message repeated %u times",repeats);
+	}
+	mSite->mLastHash = hash;
+	mSite->mLastPriority = mPriority;
+	mSite->mLastTime = now;
+	return false;
+}
+
+// Write the "last message repeated N times" of the sites that have been quiet for Log.FoldRepeats seconds.
+// The async writer calls this from its timer, so the count does not wait for the next record from the site.
+static void logFoldSummaries()
+{
+	static time_t sLastCheck = 0;
+	time_t now = time(NULL);
+	if (now == sLastCheck) return;
+	sLastCheck = now;
+	int window = sLogFoldWindow;
+	for (LogSite *site = sLogSites; site; site = site->mNext) {
+		if (site->mRepeats == 0 || now - site->mLastTime < window) continue;
+		if (unsigned repeats = __sync_lock_test_and_set(&site->mRepeats,0)) {
+			logSiteSummary(site->mLastPriority,site,"last message repeated %u times",repeats);
+		}
+	}
+}
+
+Log::~Log()
+{
+	if (mDummyInit) return;
+	const char *record = mBuf.data();
+	unsigned len = mBuf.size();
+	if (record == NULL) { record = ""; }
+	if (sFlightLevel >= mPriority) { flightRecord(mPriority,mSite,record+mBodyOffset,len-mBodyOffset); }
+	if (!mWrite) return;
+	if (mSite) {
+		if (unsigned dropped = __sync_lock_test_and_set(&mSite->mRateSuppressed,0)) {
+			logSiteSummary(mPriority,mSite,"%u lines suppressed by rate limit",dropped);
+		}
+		// Alarms are never folded.
+		if (mPriority > LOG_CRIT && fold(record,len)) return;
+	}
+	// Anything at or above LOG_CRIT is an "alarm".
+	// Save alarms in the local list and echo them to stderr.
+	if (mPriority <= LOG_CRIT) {
+		alarmAdd(mPriority,mSite,record,len);
+		cerr.write(record,len);
+		cerr << endl;
+	}
+	// Current logging level was already checked by the macro.
+	// So just log.
+	logWriteRecord(mPriority,record,len);
+}
+
 
 // (pat) This is the log initialization function.
 // It is invoked by this line in OpenBTS.cpp, and similar lines in other programs like the TransceiverRAD1:
 // 		Log dummy("openbts",gConfig.getStr("Log.Level").c_str(),LOG_LOCAL7);
 // The LOCAL7 corresponds to the "local7" line in the file /etc/rsyslog.d/OpenBTS.log.
 Log::Log(const char* name, const char* level, int facility)
+	:mStream(&mBuf)
 {
 	// (pat) This 'constructor' has nothing to do with the regular use of the Log class, so we have
 	// to set this special flag to prevent the destructor from generating a syslog message.
@@ -254,14 +1272,49 @@ Log::Log(const char* name, const char* level, int facility)
 }
 
 
-ostringstream& Log::get()
+ostream& Log::get()
 {
 	assert(mPriority<numLevels);
-	mStream << levelNames[mPriority] <<  ' ';
+	if (!mWrite) {
+		// Only for the flight recorder, which formats the header itself if it ever needs it.
+	} else if (mSite) {
+		char header[400];
+		mStream.write(header,logSiteHeader(header,sizeof(header),mPriority,mSite));
+		mBodyOffset = mBuf.size();
+	} else {
+		mStream << levelNames[mPriority] <<  ' ';
+	}
 	return mStream;
 }
 
 
+// The signals that mean the process is about to die with records still in memory.
+static const int sLogCrashSignals[] = { SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL };
+
+/**
+	Register the crash handlers of the features that are on with gSigVec, once each.
+	Only called from gLogInit, since gSigVec may not be constructed yet when a static constructor logs.
+*/
+static void logCrashHandlersRegister()
+{
+	static bool sAsyncRegistered = false;
+	static bool sFlightRegistered = false;
+	// The flush goes first, so the records that made it out of the ring are in Log.File before the flight recorder is written.
+	if (sLogQueue && !sAsyncRegistered) {
+		sAsyncRegistered = true;
+		for (unsigned i = 0; i < sizeof(sLogCrashSignals)/sizeof(sLogCrashSignals[0]); i++) {
+			gSigVec.Register(gLogCrashFlush,sLogCrashSignals[i]);
+		}
+	}
+	if (gConfig.getStr("Log.FlightRecorder").size() && !sFlightRegistered) {
+		sFlightRegistered = true;
+		for (unsigned i = 0; i < sizeof(sLogCrashSignals)/sizeof(sLogCrashSignals[0]); i++) {
+			gSigVec.Register(gLogFlightRecorderSignal,sLogCrashSignals[i]);
+		}
+	}
+}
+
+
 // Allow applications to also pass in a filename.  Filename should come from the database
 void gLogInitWithFile(const char* name, const char* level, int facility, char * LogFilePath)
 {
@@ -270,21 +1323,21 @@ void gLogInitWithFile(const char* name, const char* level, int facility, char *
 		gConfig.set("Log.Level",level);
 	}
 
-	if (gLogToFile==0 && LogFilePath != 0 && *LogFilePath != 0 && strlen(LogFilePath) > 0) {
-		gLogToFile = fopen(LogFilePath,"w"); // New log file each time we start.
-		if (gLogToFile) {
-			string when = Timeval::isoTime(time(NULL),true);
-			fprintf(gLogToFile,"Starting at %s\n",when.c_str());
-			fflush(gLogToFile);
-			std::cerr << name <<" logging to file: " << LogFilePath << "\n";
-		}
+	if (LogFilePath != 0 && *LogFilePath != 0 && strlen(LogFilePath) > 0) {
+		logFileOpen(name,LogFilePath);
 	}
 
 	// Open the log connection.
-	openlog(name,0,facility);
+	logSyslogStart(name,facility);
 
 	// We cant call this from the Mutex itself because the Logger uses Mutex.
 	gMutexLogLevel = gGetLoggingLevel("Mutex.cpp");
+
+	if (gConfig.getBool("Log.Async")) {
+		logAsyncStart(gConfig.getNum("Log.Async.QueueSize"), gConfig.getStr("Log.Async.Overflow") == "drop");
+	}
+	gBinaryLogInit();
+	logCrashHandlersRegister();
 }
 
 
@@ -300,24 +1353,24 @@ void gLogInit(const char* name, const char* level, int facility)
 	// Pat added, tired of the syslog facility.
 	// Both the transceiver and OpenBTS use this same Logger class, but only RMSC/OpenBTS/OpenNodeB may use this log file:
 	string str = gConfig.getStr("Log.File");
-	if (gLogToFile==0 && str.length() && (0==strncmp(gCmdName,"Open",4) || 0==strncmp(gCmdName,"RMSC",4) || 0==strncmp(gCmdName,"RangeFinderGW",13))) {
+	if (str.length() && (0==strncmp(gCmdName,"Open",4) || 0==strncmp(gCmdName,"RMSC",4) || 0==strncmp(gCmdName,"RangeFinderGW",13))) {
 		const char *fn = str.c_str();
 		if (fn && *fn && strlen(fn)>3) {	// strlen because a garbage char is getting in sometimes.
-			gLogToFile = fopen(fn,"w"); // New log file each time we start.
-			if (gLogToFile) {
-				string when = Timeval::isoTime(time(NULL),true);
-				fprintf(gLogToFile,"Starting at %s\n",when.c_str());
-				fflush(gLogToFile);
-				std::cerr << name <<" logging to file: " << fn << "\n";
-			}
+			logFileOpen(name,fn);
 		}
 	}
 
 	// Open the log connection.
-	openlog(name,0,facility);
+	logSyslogStart(name,facility);
 
 	// We cant call this from the Mutex itself because the Logger uses Mutex.
 	gMutexLogLevel = gGetLoggingLevel("Mutex.cpp");
+
+	if (gConfig.getBool("Log.Async")) {
+		logAsyncStart(gConfig.getNum("Log.Async.QueueSize"), gConfig.getStr("Log.Async.Overflow") == "drop");
+	}
+	gBinaryLogInit();
+	logCrashHandlersRegister();
 }
 
 
@@ -333,7 +1386,7 @@ void gLogEarly(int level, const char *fmt, ...)
 // Return _NumberOfLogGroups if invalid.
 LogGroup::Group LogGroup::groupNameToIndex(const char *groupName) const
 {
-	for (unsigned g = (Group)0; g < _NumberOfLogGroups; g++) {
+	for (int g = 0; g < mNumGroups; g++) {
 		if (0 == strcasecmp(mGroupNames[g],groupName)) { return (Group) g; }	// happiness
 	}
 	return _NumberOfLogGroups;	// failed
@@ -342,7 +1395,35 @@ LogGroup::Group LogGroup::groupNameToIndex(const char *groupName) const
 LogGroup::LogGroup() { LogGroupInit(); }
 
 // These must match LogGroup::Group.
-const char *LogGroup::mGroupNames[] = { "Control", "SIP", "GSM", "GPRS", "Layer2", "SMS", NULL };
+const char *LogGroup::mGroupNames[sMaxGroups] = { "Control", "SIP", "GSM", "GPRS", "Layer2", "SMS", NULL };
+volatile int LogGroup::mNumGroups = _NumberOfLogGroups;
+volatile int LogGroup::mRegistryLock = 0;
+
+int LogGroup::registerGroup(const char *name)
+{
+	while (__sync_lock_test_and_set(&mRegistryLock,1)) { sched_yield(); }
+	int g;
+	for (g = 0; g < mNumGroups; g++) {
+		if (0 == strcasecmp(mGroupNames[g],name)) break;
+	}
+	bool added = false;
+	if (g == mNumGroups) {
+		if (g < sMaxGroups) {
+			mGroupNames[g] = strdup(name);
+			mDebugLevel[g] = 0;
+			mWatchLevel[g] = 0;
+			__sync_synchronize();
+			mNumGroups = g + 1;
+			added = true;
+		} else {
+			g = -1;
+		}
+	}
+	__sync_lock_release(&mRegistryLock);
+	if (added) { gLogConfigChanged(); }	// So its levels get read.
+	if (g < 0) { LOG(ERR) << "too many log groups, cannot add " << name; }
+	return g;
+}
 
 void LogGroup::LogGroupInit()
 {
@@ -355,13 +1436,11 @@ void LogGroup::LogGroupInit()
 
 	// Error check mGroupNames is the correct length;
 	unsigned g;
-	for (g = 0; mGroupNames[g]; g++) { continue; }
+	for (g = 0; g < _NumberOfLogGroups && mGroupNames[g]; g++) { continue; }
 	assert(g == _NumberOfLogGroups);	// If you get this, go fix mGroupNames to match enum LogGroup::Group.
 
-	for (unsigned g = 0; g < _NumberOfLogGroups; g++) {
-		mDebugLevel[g] = 0;
-		mWatchLevel[g] = 0;
-	}
+	// The levels are statically zero, and may already have been read by a LOG() in another static constructor.
+	mGeneration = 0;
 
 #if 0
 	if (mGroupNameToIndex.size()) { return; }	// inited previously.
@@ -374,25 +1453,26 @@ void LogGroup::LogGroupInit()
 }
 
 
-static const char*getNonEmptyStrIfDefined(string param)
+static string getNonEmptyStrIfDefined(string param)
 {
-	if (! gConfig.defines(param)) { return NULL; }
-	string result = gConfig.getStr(param);
+	if (! gConfig.defines(param)) { return string(); }
 	// (pat) The "unconfig" command does not remove the value, it just gives it an empty value, so check for that.
-	return result.size() ? result.c_str() : NULL;
+	return gConfig.getStr(param);
 }
 
 // Set all the Log.Group debug levels based on database settings
-void LogGroup::setAll()
+void LogGroup::refresh()
 {
-	LOG(DEBUG);
+	// Sample the generation first so a change that happens while we are reading is not lost.
+	int gen = gLogGeneration;
 	string groupprefix = string("Log.Group.");
 	string watchprefix = string("Log.Watch.");
-	for (unsigned g = 0; g < _NumberOfLogGroups; g++) {
+	for (int g = 0; g < mNumGroups; g++) {
 		{
 		string param = groupprefix + mGroupNames[g];
 		int level = 0;
-		if (const char*levelName = getNonEmptyStrIfDefined(param)) {
+		string levelName = getNonEmptyStrIfDefined(param);
+		if (levelName.size()) {
 			level = lookupLevel2(param,levelName);
 		}
 		mDebugLevel[g] = level;
@@ -401,12 +1481,21 @@ void LogGroup::setAll()
 		{
 		string watchparam = watchprefix + mGroupNames[g];
 		int watchlevel = 0;
-		if (const char*levelName = getNonEmptyStrIfDefined(watchparam)) {
+		string levelName = getNonEmptyStrIfDefined(watchparam);
+		if (levelName.size()) {
 			watchlevel = lookupLevel2(watchparam,levelName);
 		}
 		mWatchLevel[g] = watchlevel;
 		}
 	}
+	__sync_synchronize();
+	mGeneration = gen;
+}
+
+// The levels are refreshed automatically now; this just makes sure it happens on the next check.
+void LogGroup::setAll()
+{
+	gLogConfigChanged();	// The LogSite caches include the group level.
 }
 
 // vim: ts=4 sw=4
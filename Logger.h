@@ -41,9 +41,11 @@
 #include <sstream>
 #include <list>
 #include <map>
+#include <vector>
 #include <string>
 #include <assert.h>
 #include <sys/syscall.h>
+#include <sys/time.h>
 // We cannot include Utils.h because it includes Logger.h, so just declare timestr() here.
 // If timestr decl is changed G++ will whine when Utils.h is included.
 namespace Utils { const std::string timestr(); };
@@ -53,29 +55,131 @@ namespace Utils { const std::string timestr(); };
 #endif // !defined(gettid)
 
 extern pid_t gPid;
+/** Names of the logging levels, indexed by LOG_EMERG..LOG_DEBUG. */
+extern const char *levelNames[];
+/** Return " YYYY-MM-DDTHH:MM:SS.t" for now, same as Utils::timestr(100,true), from a per-thread buffer. */
+const char *gLogTimestamp();
 #define _LOG(level) \
 	Log(LOG_##level).get() <<gPid <<":"<<gettid() \
-	<< Utils::timestr(100,true) << " " __FILE__  ":"  << __LINE__ << ":" << __FUNCTION__ << ": "
+	<< gLogTimestamp() << " " __FILE__  ":"  << __LINE__ << ":" << __FUNCTION__ << ": "
+
+/**
+	Per-call-site logging state.  Every LOG() statement owns one of these as a function static.
+	It is a POD initialized at compile time, so it works before any constructors have run.
+	The level is cached until gLogGeneration changes, which happens whenever a Log.* config key changes,
+	so a suppressed LOG() costs a load and a compare instead of a hash, a mutex and a map lookup.
+	mRecordLevel is lower than mLevel when the crash flight recorder wants records that are not written.
+	The rest of the fields are used for rate limiting and repeated-message folding.
+*/
+struct LogSite {
+	const char *mFile;
+	unsigned mLine;
+	const char *mFunction;
+	int mGroup;					///< LogGroup handle of the file, or -1.
+	const char *mGroupName;		///< LOG_GROUP_NAME of the file, registered as a LogGroup the first time the site is used.
+	volatile int mGeneration;	///< gLogGeneration when mLevel was computed; 0 means never.
+	volatile int mLevel;		///< Cached logging level for this file and group.
+	volatile int mRecordLevel;	///< Cached level at which LOG() builds a record: mLevel or Log.FlightRecorder.
+	volatile uint64_t mBucket;	///< LOG_RATELIMITED token bucket: msecs of last refill << 32 | milli-tokens.
+	volatile unsigned mRateSuppressed;	///< Lines dropped by the rate limit since the last one written.
+	volatile uint32_t mLastHash;	///< Hash of the text of the last record written from here.
+	volatile time_t mLastTime;		///< When it was written.
+	volatile int mLastPriority;		///< Its level.
+	volatile unsigned mRepeats;		///< Identical records folded since then.
+	volatile unsigned mSuppressed;	///< Total lines suppressed at this site, for gLogSiteStats.
+	volatile int mRegistered;
+	LogSite *mNext;				///< All the sites that have been used, for gLogSiteStats.
+	volatile unsigned mBinarySegment;	///< The BLOG() segment this site was last described in.
+	volatile unsigned mSample;		///< Cached Log.Sample for this file or group: write 1 in this many records.
+	volatile unsigned mSampled;		///< Total lines dropped by sampling, for gLogSiteStats.
+	volatile unsigned mSampleCount;	///< Records seen by sampling, from all threads.
+};
+extern volatile int gLogGeneration;
+/** Recompute the cached level of a call site; the slow path of gLogSiteLevel. */
+int gLogSiteRefresh(LogSite *site);
+/** Invalidate all the per-call-site caches.  ConfigurationTable calls this when a Log.* key changes. */
+void gLogConfigChanged();
+/** Return the site if LOG_RATELIMITED lets this line through, else NULL and count it as suppressed. */
+LogSite *gLogSiteRateCheck(LogSite *site, unsigned perSecond, unsigned burst);
+/** Return the site if this is the record in every mSample that sampling lets through, else NULL. */
+LogSite *gLogSiteSample(LogSite *site);
+/** Print the call sites that have suppressed or sampled out lines, and how many. */
+void gLogSiteStats(std::ostream &os);
+
+static __inline__ LogSite *gLogSiteFresh(LogSite *site) {
+	if (site->mGeneration != gLogGeneration) { gLogSiteRefresh(site); }
+	return site;
+}
+static __inline__ int gLogSiteLevel(LogSite *site) {
+	return gLogSiteFresh(site)->mLevel;
+}
+// Sampling (Log.Sample.<file> or Log.Sample.<group> = N) writes only 1 in N records from each site; alarms are never sampled.
+static __inline__ LogSite *gLogSiteCheck(LogSite *site, int level) {
+	if (gLogSiteFresh(site)->mRecordLevel < level) return (LogSite*)0;
+	return (site->mSample > 1 && level > LOG_CRIT) ? gLogSiteSample(site) : site;
+}
 
 // (pat) If you '#define LOG_GROUP groupname' before including Logger.h, then you can set Log.Level.groupname as well as Log.Level.filename.
+// For a group that is not one of the built-in LogGroup::Group values, '#define LOG_GROUP_NAME "name"' instead;
+// the group is registered the first time a LOG() in the file is used, and Log.Group.name controls it.
 #ifdef LOG_GROUP
-//#define CHECK_GROUP_LOG_LEVEL(groupname,loglevel) gCheckGroupLogLevel(#groupname,loglevel)
-//#define IS_LOG_LEVEL(wLevel) (CHECK_GROUP_LOG_LEVEL(LOG_GROUP,LOG_##wLevel) || gGetLoggingLevel(__FILE__)>=LOG_##wLevel)
-#define IS_LOG_LEVEL(wLevel) (gCheckGroupLogLevel(LOG_GROUP,LOG_##wLevel) || gGetLoggingLevel(__FILE__)>=LOG_##wLevel)
-#define IS_WATCH_LEVEL(wLevel) gCheckGroupWatchLevel(LOG_GROUP,LOG_##wLevel)
+#define _LOG_SITE_GROUP LOG_GROUP
 #else
-#define IS_WATCH_LEVEL(wLevel) (gGetLoggingLevel(__FILE__)>=LOG_##wLevel)
-#define IS_LOG_LEVEL(wLevel) (gGetLoggingLevel(__FILE__)>=LOG_##wLevel)
+#define _LOG_SITE_GROUP -1
+#endif
+#ifdef LOG_GROUP_NAME
+#define _LOG_SITE_GROUP_NAME LOG_GROUP_NAME
+#else
+#define _LOG_SITE_GROUP_NAME 0
 #endif
 
+// The static LogSite of the enclosing call site.  This uses a g++ statement expression to give each LOG() its own.
+// Every field has an initializer, so -Wextra does not warn at each LOG(); keep the zeros in step with LogSite.
+#define _LOG_SITE ({ static LogSite _rnLogSite = { __FILE__, __LINE__, __FUNCTION__, _LOG_SITE_GROUP, _LOG_SITE_GROUP_NAME, \
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }; &_rnLogSite; })
+#define _LOG_SITE_LEVEL gLogSiteLevel(_LOG_SITE)
+
+// Like _LOG but the Log gets the header (pid, time, file, line, function) from the site.
+#define _LOG_SITE_RECORD(level,site) Log(LOG_##level,site).get()
+
+// RN_LOG_COMPILE_MIN is the least important level that is compiled in.  LOG() statements of less important levels,
+// and IS_LOG_LEVEL, IS_WATCH_LEVEL and everything built on them, become constant false, so the compiler drops them
+// along with the evaluation of their arguments.  Eg, build with -DRN_LOG_COMPILE_MIN=LOG_NOTICE to remove INFO and DEBUG,
+// or -DRN_LOG_COMPILE_MIN=-1 to remove all logging.
+// If it is not set, NDEBUG builds remove LOG(DEBUG) statements and nothing else, as they always have:
+// IS_LOG_LEVEL(DEBUG) and IS_WATCH_LEVEL(DEBUG), and so the console part of WATCH and the DEBUG branch of devassert, stay.
+#ifdef RN_LOG_COMPILE_MIN
+#define RN_LOG_CHECK_MIN RN_LOG_COMPILE_MIN
+#else
+#define RN_LOG_CHECK_MIN LOG_DEBUG
 #ifdef NDEBUG
-#define LOG(wLevel) \
-	if (LOG_##wLevel!=LOG_DEBUG && IS_LOG_LEVEL(wLevel)) _LOG(wLevel)
+#define RN_LOG_COMPILE_MIN LOG_INFO
 #else
-#define LOG(wLevel) \
-	if (IS_LOG_LEVEL(wLevel)) _LOG(wLevel)
+#define RN_LOG_COMPILE_MIN LOG_DEBUG
+#endif
+#endif
+#define RN_LOG_COMPILED(wLevel) (LOG_##wLevel <= RN_LOG_COMPILE_MIN)
+#define RN_LOG_CHECK_COMPILED(wLevel) (LOG_##wLevel <= RN_LOG_CHECK_MIN)
+
+#define IS_LOG_LEVEL(wLevel) (RN_LOG_CHECK_COMPILED(wLevel) && _LOG_SITE_LEVEL>=LOG_##wLevel)
+#ifdef LOG_GROUP
+#define IS_WATCH_LEVEL(wLevel) (RN_LOG_CHECK_COMPILED(wLevel) && gCheckGroupWatchLevel(LOG_GROUP,LOG_##wLevel))
+#else
+#define IS_WATCH_LEVEL(wLevel) (RN_LOG_CHECK_COMPILED(wLevel) && _LOG_SITE_LEVEL>=LOG_##wLevel)
 #endif
 
+#define LOG(wLevel) \
+	if (!RN_LOG_COMPILED(wLevel)) {} \
+	else if (LogSite *_rnSite = gLogSiteCheck(_LOG_SITE,LOG_##wLevel)) _LOG_SITE_RECORD(wLevel,_rnSite)
+
+// Like LOG, but let at most perSecond lines per second through from this call site, with bursts of up to burst lines.
+// The dropped lines are counted and reported with the next line that gets through.
+// Records below the logging level, which only go to the flight recorder, are not limited and do not use up the burst.
+#define LOG_RATELIMITED(wLevel,perSecond,burst) \
+	if (!RN_LOG_COMPILED(wLevel)) {} \
+	else if (LogSite *_rnSite = gLogSiteCheck(_LOG_SITE,LOG_##wLevel)) \
+		if (LOG_##wLevel > _rnSite->mLevel || gLogSiteRateCheck(_rnSite,perSecond,burst)) _LOG_SITE_RECORD(wLevel,_rnSite)
+
 // pat: And for your edification here are the 'levels' as defined in syslog.h:
 // LOG_EMERG   0  system is unusable
 // LOG_ALERT   1  action must be taken immediately
@@ -105,11 +209,13 @@ extern pid_t gPid;
 #define OBJLOG(wLevel) \
 	LOG(wLevel) << "obj: " << this << ' '
 
-#define LOG_ASSERT(x) { if (!(x)) LOG(EMERG) << "assertion " #x " failed"; } assert(x);
+#define LOG_ASSERT(x) { if (RN_LOG_COMPILED(EMERG) && !(x)) { LOG(EMERG) << "assertion " #x " failed"; } } assert(x);
 
 // (pat) The WATCH and WATCHF macros print only to the console.  Pat uses them for debugging.
 // The WATCHINFO macro prints an INFO level message that is also printed to the console if the log level is DEBUG.
 // Beware that the arguments are evaluated multiple times.
+// They all compile to nothing if their level is below RN_LOG_COMPILE_MIN, since LOG and IS_WATCH_LEVEL do;
+// a plain NDEBUG build drops only their LOG part.
 #define WATCHF(...)  { LOG(DEBUG)<<format(__VA_ARGS__); if (IS_WATCH_LEVEL(DEBUG)) {printf("%s ",timestr(7).c_str()); printf(__VA_ARGS__);} }
 #define WATCHLEVEL(level,...) if (IS_WATCH_LEVEL(level)) {std::cout << timestr(7)<<" "<<__VA_ARGS__ << std::endl;}
 #define WATCH(...) { LOG(DEBUG)<<__VA_ARGS__; if (IS_WATCH_LEVEL(DEBUG)) {std::cout << timestr(7)<<" "<<__VA_ARGS__ << endl;} }
@@ -119,6 +225,28 @@ extern pid_t gPid;
 //#include "Threads.h"		// must be after defines above, if these files are to be allowed to use LOG()
 //#include "Utils.h"
 
+/**
+	The streambuf behind a Log record.
+	It formats into a fixed per-thread buffer, so steady-state logging does no heap allocation,
+	and only moves to the heap if the record outgrows that buffer or the thread is already
+	in the middle of another record (eg, a LOG() inside an operator<< of a LOG()).
+*/
+class LogStreamBuf : public std::streambuf {
+	bool mThreadBuffer;		///< True if we own the per-thread buffer.
+	bool mHeap;				///< True if pbase() was malloced.
+	void grow(size_t needed);
+
+	protected:
+	int_type overflow(int_type c);
+	std::streamsize xsputn(const char *s, std::streamsize n);
+
+	public:
+	LogStreamBuf() : mThreadBuffer(false), mHeap(false) { }
+	~LogStreamBuf();
+	const char *data() const { return pbase(); }
+	unsigned size() const { return pptr() - pbase(); }
+};
+
 /**
 	A C++ stream-based thread-safe logger.
 	Derived from Dr. Dobb's Sept. 2007 issue.
@@ -132,14 +260,19 @@ class Log {
 
 	protected:
 
-	std::ostringstream mStream;		///< This is where we buffer up the log entry.
+	LogStreamBuf mBuf;				///< This is where we buffer up the log entry.
+	std::ostream mStream;			///< Formats into mBuf.
 	int mPriority;					///< Priority of current report.
 	bool mDummyInit;
+	LogSite *mSite;					///< The LOG() call site, or NULL for _LOG.
+	unsigned mBodyOffset;			///< Where the text after the header starts in mBuf.
+	bool mWrite;					///< False if the record is only for the flight recorder.
 
 	public:
 
-	Log(int wPriority)
-		:mPriority(wPriority), mDummyInit(false)
+	Log(int wPriority, LogSite *wSite = 0)
+		:mStream(&mBuf), mPriority(wPriority), mDummyInit(false), mSite(wSite), mBodyOffset(0),
+		mWrite(!wSite || wPriority <= wSite->mLevel)
 	{ }
 
 	// (pat) This constructor is not used to construct a Log record, it is called once per application
@@ -150,12 +283,19 @@ class Log {
 	/** The destructor actually generates the log entry. */
 	~Log();
 
-	std::ostringstream& get();
+	std::ostream& get();
+
+	private:
+	bool fold(const char *record, unsigned len);
 };
 extern bool gLogToConsole;	// Pat added for easy debugging.
 
 
 // (pat) Added logging by explicit group name.
+// Groups are identified by a small integer handle.  The built-in groups below always have these handles;
+// more can be added at run time with registerGroup().  The levels are kept in flat arrays indexed by handle
+// and re-read from Log.Group.<name> and Log.Watch.<name> the first time they are checked after any Log.* config change,
+// so a check is a compare and an array load with no lock.
 class LogGroup {
 	public:
 	// These must exactly match LogGroup::mGroupNames:
@@ -169,33 +309,60 @@ class LogGroup {
 		SMS,
 		_NumberOfLogGroups
 	};
-	void setAll();	// Update mDebugLevel from the Log.Group.... config database options.
-
-	int8_t mDebugLevel[_NumberOfLogGroups];	// use int in case a -1 value gets in here.
-	int8_t mWatchLevel[_NumberOfLogGroups];	// use int in case a -1 value gets in here.
+	static const int sMaxGroups = 64;
+	void setAll();	// Mark the levels stale so they are re-read from the Log.Group.... config database options.
+	void refresh();	// Re-read the levels now; gCheckGroupLogLevel does this when gLogGeneration changes.
+
+	/** Return the handle of the group with this name, adding it if it is new, or -1 if there are already sMaxGroups. */
+	int registerGroup(const char *name);
+	int numGroups() const { return mNumGroups; }
+	const char *groupName(int group) const { return (group >= 0 && group < mNumGroups) ? mGroupNames[group] : NULL; }
+
+	int8_t mDebugLevel[sMaxGroups];	// use int in case a -1 value gets in here.
+	int8_t mWatchLevel[sMaxGroups];	// use int in case a -1 value gets in here.
+	volatile int mGeneration;		// gLogGeneration when the levels were read.
 	LogGroup();
 	void LogGroupInit();
 	private:
-	static const char *mGroupNames[_NumberOfLogGroups+1];	// We add a NULL at the end.
+	// These are statically initialized with the built-in groups so groups can be registered before constructors run.
+	static const char *mGroupNames[sMaxGroups];
+	static volatile int mNumGroups;
+	static volatile int mRegistryLock;
 	Group groupNameToIndex(const char *) const;		// unused.
 };
 extern LogGroup gLogGroup;
 
 // We inline this:
-static __inline__ bool gCheckGroupLogLevel(LogGroup::Group group, unsigned level) {
-	assert(group < LogGroup::_NumberOfLogGroups);
+static __inline__ bool gCheckGroupLogLevel(int group, unsigned level) {
+	assert(group >= 0 && group < LogGroup::sMaxGroups);
+	if (gLogGroup.mGeneration != gLogGeneration) { gLogGroup.refresh(); }
 	//_LOG(DEBUG) << LOGVAR(group)<<LOGVAR(level)<<LOGVAR2("stashed",(unsigned) gLogGroup.mDebugLevel[group]);
 	return gLogGroup.mDebugLevel[group] >= (int) level;
 }
-static __inline__ bool gCheckGroupWatchLevel(LogGroup::Group group, unsigned level) {
-	assert(group < LogGroup::_NumberOfLogGroups);
+static __inline__ bool gCheckGroupWatchLevel(int group, unsigned level) {
+	assert(group >= 0 && group < LogGroup::sMaxGroups);
+	if (gLogGroup.mGeneration != gLogGeneration) { gLogGroup.refresh(); }
 	//_LOG(DEBUG) << LOGVAR(group)<<LOGVAR(level)<<LOGVAR2("stashed",(unsigned) gLogGroup.mDebugLevel[group]);
 	return gLogGroup.mWatchLevel[group] >= (int) level;
 }
 
 
 
+/** An alarm (a record at CRIT or above) as kept by the logger. */
+struct LoggerAlarm {
+	unsigned mSequence;			///< Counts all the alarms since startup, so gaps show how many were missed.
+	struct timeval mTime;
+	int mPriority;
+	const LogSite *mSite;		///< NULL for _LOG records.
+	std::string mText;			///< The whole record, header included.
+};
+
 std::list<std::string> gGetLoggerAlarms();		///< Get a copy of the recent alarm list.
+/**
+	Get the most recent Log.Alarms.Max alarms, oldest first, without taking any lock.
+	Returns the sequence number the next alarm will get.
+*/
+unsigned gGetLoggerAlarms(std::vector<LoggerAlarm> &alarms);
 
 
 /**@ Global control and initialization of the logging system. */
@@ -211,6 +378,26 @@ void gLogInit(const char* name, const char* level=NULL, int facility=LOG_USER);
 int gGetLoggingLevel(const char *filename=NULL);
 /** Allow early logging when still in constructors */
 void gLogEarly(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+/** Write out any records still waiting in the async log queue.  A no-op unless Log.Async is set. */
+void gLogFlush();
+/**
+	Like gLogFlush but for use from a crash.  gLogInit registers it with gSigVec for SIGSEGV, SIGABRT, SIGBUS, SIGFPE
+	and SIGILL if Log.Async is on.
+	Only write(2) to Log.File and stderr is used, since locks, stdio and syslog() are not safe in a signal handler,
+	so the records that would only have gone to syslog go to stderr.
+*/
+void gLogCrashFlush(int sig);
+/** Number of records discarded because the async log queue was full. */
+unsigned long gLogDroppedCount();
+/** Number of records the Log.Syslog.Direct sink discarded because syslogd was not keeping up or not there. */
+unsigned long gLogSyslogDroppedCount();
+/**
+	Write the crash flight recorder, the last Log.FlightRecorder.Records records of every thread
+	down to level Log.FlightRecorder, to Log.FlightRecorder.File.
+	Only async-signal-safe calls are used.  gLogInit registers it with gSigVec for the same signals as gLogCrashFlush
+	if Log.FlightRecorder is on; an application that turns the flight recorder on later has to register it itself.
+*/
+void gLogFlightRecorderSignal(int sig);
 //@}
 
 // (pat) This is historical, some files include Logger.h and expect to get these too.  These should be removed.
@@ -45,7 +45,7 @@ ReportingTable::ReportingTable(const char* filename)
 	int rc = sqlite3_open(filename,&mDB);
 	if (rc) {
 		gLogEarly(LOG_EMERG | mFacility, "cannot open reporting database at %s, error message: %s", filename, sqlite3_errmsg(mDB));
-		sqlite3_close(mDB);
+		sqlite_close(mDB);
 		mDB = NULL;
 		return;
 	}
@@ -116,6 +116,7 @@ bool resolveAddress(struct sockaddr_in *address, const char *host, unsigned shor
 
 
 DatagramSocket::DatagramSocket()
+	:mSocketFD(-1)
 {
 	memset(mDestination, 0, sizeof(mDestination));
 }
@@ -136,7 +137,8 @@ void DatagramSocket::blocking()
 
 void DatagramSocket::close()
 {
-	::close(mSocketFD);
+	if (mSocketFD >= 0) ::close(mSocketFD);
+	mSocketFD = -1;
 }
 
 
@@ -169,6 +171,24 @@ int DatagramSocket::writeBack( const char * message, size_t length )
 
 
 
+int DatagramSocket::writeBatch(const struct iovec *packets, unsigned count)
+{
+	struct mmsghdr msgs[64];
+	if (count > 64) count = 64;
+	memset(msgs,0,count*sizeof(*msgs));
+	for (unsigned i = 0; i < count; i++) {
+		msgs[i].msg_hdr.msg_name = mDestination;
+		msgs[i].msg_hdr.msg_namelen = addressSize();
+		msgs[i].msg_hdr.msg_iov = const_cast<struct iovec*>(&packets[i]);
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	int sent = sendmmsg(mSocketFD, msgs, count, MSG_DONTWAIT);
+	if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+	return sent;
+}
+
+
+
 int DatagramSocket::write( const char * message)
 {
 	size_t length=strlen(message)+1;
@@ -332,6 +352,8 @@ void UDDSocket::open(const char* localPath)
 		throw SocketError();
 	}
 
+	if (localPath == NULL) return;
+
 	// bind
 	struct sockaddr_un address;
 	size_t length = sizeof(address);
@@ -353,6 +375,7 @@ void UDDSocket::open(const char* localPath)
 void UDDSocket::destination(const char* remotePath)
 {
 	struct sockaddr_un* unAddr = (struct sockaddr_un*)mDestination;
+	unAddr->sun_family = AF_UNIX;
 	strcpy(unAddr->sun_path,remotePath);
 }
 
@@ -32,6 +32,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <list>
 #include <stdint.h>
@@ -104,6 +105,15 @@ public:
 	*/
 	int writeBack(const char * buffer);
 
+	/**
+		Send several packets to mDestination with one system call.
+		Unlike write() this does not print anything on error, so it can be used by the Logger.
+		@param packets The packets.
+		@param count Number of packets.
+		@return number of packets sent, which is less than count if the socket would block, or -1 on error with errno set.
+	*/
+	int writeBatch(const struct iovec *packets, unsigned count);
+
 
 	/**
 		Receive a packet.
@@ -183,6 +193,7 @@ public:
 
 	void destination(const char* remotePath);
 
+	/** Open the socket and bind it to localPath, or leave it unbound if localPath is NULL, which is enough for sending. */
 	void open(const char* localPath);
 
 	/** Give the return address of the most recently received packet. */
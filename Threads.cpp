@@ -120,6 +120,13 @@ bool Mutex::trylock(const char *file, unsigned line)
 	}
 }
 
+void Mutex::resetAfterFork()
+{
+	pthread_mutex_init(&mMutex,&mAttribs);
+	mLockCnt = 0;
+	memset(mLockerFile,0,sizeof(mLockerFile));
+}
+
 // Returns true if the lock was acquired within the timeout, or false if it timed out.
 bool Mutex::timedlock(int msecs) // Wait this long in milli-seconds.
 {
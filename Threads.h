@@ -107,6 +107,12 @@ class Mutex {
 
 	void unlock();
 
+	/**
+		In the child of a fork, make a mutex that was locked at the fork unlocked again.
+		Unlocking it would not do, since a recursive mutex belongs to the thread id that locked it, which the child does not have.
+	*/
+	void resetAfterFork();
+
 	// (pat) I use this to assert that the Mutex is locked on entry to some method that requres it, but only in debug mode.
 	int lockcnt() { return mLockCnt; }
 
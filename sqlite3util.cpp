@@ -30,7 +30,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <pthread.h>
 
+#include <map>
 #include <string>
 #include <vector>
 using namespace std;
@@ -85,34 +87,137 @@ int sqlite3_run_query(sqlite3* DB, sqlite3_stmt *stmt, unsigned retries)
 	return src;
 }
 
-// condition buffer is size 100 minimum.
-static const unsigned sqlBufferSize = 100;
-static const char *condition_c(char *resultBuffer,const char *keyName, const char*keyValue)
+/**@name The statement cache.
+	Each connection has its own StatementCache, with its own lock, so connections do not contend with each other.
+	sqlite_close finalizes the idle statements and frees the cache before it closes the connection.
+	There is no close hook: that would need sqlite3_trace_v2, which is only in sqlite 3.14 and later, and would replace
+	any trace hook of the application.  A plain sqlite3_close of a connection with cached statements fails with
+	SQLITE_BUSY and leaves the connection open, so its cache can never be handed to another connection at the same address.
+	sStatementCaches only finds the cache of a connection; it is allocated on first use because ConfigurationTable
+	uses it from static constructors, and never freed.
+*/
+//@{
+struct StatementCache {
+	pthread_mutex_t mLock;
+	map<string,vector<sqlite3_stmt*> > mIdle;	///< idle statements by sql text
+	unsigned mSize;
+	StatementCache() : mSize(0) { pthread_mutex_init(&mLock,NULL); }
+	~StatementCache() { pthread_mutex_destroy(&mLock); }
+};
+typedef map<sqlite3*,StatementCache*> StatementCacheMap;
+static pthread_rwlock_t sStatementCachesLock = PTHREAD_RWLOCK_INITIALIZER;
+// Statements beyond this many per connection are finalized when released, so one-off sql does not pile up.
+static const unsigned sStatementCacheMax = 64;
+
+static StatementCacheMap &statementCaches()
+{
+	static StatementCacheMap *caches = new StatementCacheMap;
+	return *caches;
+}
+
+/** Return the cache of DB, or NULL if it has none and create is false. */
+static StatementCache *statementCache(sqlite3* DB, bool create);
+
+/** Remove the cache of DB from sStatementCaches, finalize its statements and free it.  sqlite_close calls this. */
+static void statementCacheDrop(sqlite3* DB)
+{
+	pthread_rwlock_wrlock(&sStatementCachesLock);
+	StatementCacheMap &caches = statementCaches();
+	StatementCacheMap::iterator where = caches.find(DB);
+	StatementCache *cache = NULL;
+	if (where != caches.end()) {
+		cache = where->second;
+		caches.erase(where);
+	}
+	pthread_rwlock_unlock(&sStatementCachesLock);
+	if (cache == NULL) return;
+	for (map<string,vector<sqlite3_stmt*> >::iterator it = cache->mIdle.begin(); it != cache->mIdle.end(); it++) {
+		for (unsigned i = 0; i < it->second.size(); i++) { sqlite3_finalize(it->second[i]); }
+	}
+	delete cache;
+}
+
+static StatementCache *statementCache(sqlite3* DB, bool create)
+{
+	pthread_rwlock_rdlock(&sStatementCachesLock);
+	StatementCacheMap &caches = statementCaches();
+	StatementCacheMap::iterator where = caches.find(DB);
+	StatementCache *cache = where == caches.end() ? NULL : where->second;
+	pthread_rwlock_unlock(&sStatementCachesLock);
+	if (cache || !create) return cache;
+
+	pthread_rwlock_wrlock(&sStatementCachesLock);
+	StatementCache *&slot = caches[DB];
+	if (slot == NULL) slot = new StatementCache;
+	cache = slot;
+	pthread_rwlock_unlock(&sStatementCachesLock);
+	return cache;
+}
+//@}
+
+sqlite3_stmt *sqlite_statement_acquire(sqlite3* DB, const char *sql, unsigned retries)
+{
+	sqlite3_stmt *stmt = NULL;
+	StatementCache *cache = statementCache(DB,true);
+	pthread_mutex_lock(&cache->mLock);
+	map<string,vector<sqlite3_stmt*> >::iterator it = cache->mIdle.find(sql);
+	if (it != cache->mIdle.end()) {
+		stmt = it->second.back();
+		it->second.pop_back();
+		if (it->second.empty()) cache->mIdle.erase(it);
+		cache->mSize--;
+	}
+	pthread_mutex_unlock(&cache->mLock);
+	if (stmt) return stmt;
+	if (sqlite3_prepare_statement(DB,&stmt,sql,retries)) return NULL;
+	return stmt;
+}
+
+void sqlite_statement_release(sqlite3_stmt *stmt)
+{
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	// The connection may have been closed while the statement was out, which dropped its cache.
+	StatementCache *cache = statementCache(sqlite3_db_handle(stmt),false);
+	if (cache) {
+		pthread_mutex_lock(&cache->mLock);
+		if (cache->mSize < sStatementCacheMax) {
+			cache->mIdle[sqlite3_sql(stmt)].push_back(stmt);
+			cache->mSize++;
+			stmt = NULL;
+		}
+		pthread_mutex_unlock(&cache->mLock);
+	}
+	if (stmt) sqlite3_finalize(stmt);
+}
+
+int sqlite_close(sqlite3* DB)
 {
-	snprintf(resultBuffer,sqlBufferSize,"WHERE %s == '%s'",keyName,keyValue);
-	return resultBuffer;
+	statementCacheDrop(DB);
+	return sqlite3_close(DB);
 }
 
-static const char *condition_u(char *resultBuffer,const char *keyName, unsigned keyValue)
+int sqlStatement::step(unsigned retries)
 {
-	snprintf(resultBuffer,sqlBufferSize,"WHERE %s == %u",keyName,keyValue);
-	return resultBuffer;
+	return mStmt ? sqlite3_run_query(sqlite3_db_handle(mStmt),mStmt,retries) : SQLITE_ERROR;
 }
 
+
 void sqlQuery::queryStart(sqlite3*db, const char *tableName,const char *resultColumns, const char*condition)
 {
 	int retries = 5;
 	mdb = db;
 	mQueryRC = SQLITE_ERROR;	// Until we know better.
-	//size_t stringSize = sqlBufferSize + strlen(resultColumns) + strlen(tableName) + strlen(condition);
-	//char query[stringSize];
-	//snprintf(query,stringSize,"SELECT %s FROM %s %s",resultColumns,tableName,condition);
 	// We save the query in a string so the caller can print it out in error messages if the query fails.
 	mQueryString = format("SELECT %s FROM %s %s",resultColumns,tableName,condition);
 	// Prepare the statement.
-	if (sqlite3_prepare_statement(mdb,&mStmt,mQueryString.c_str(),retries)) { mStmt = NULL; return; }
+	mStmt = sqlite_statement_acquire(mdb,mQueryString.c_str(),retries);
+}
+
+void sqlQuery::queryRun()
+{
 	// Read the result.
-	mQueryRC = sqlite3_run_query(mdb,mStmt,retries);
+	if (mStmt) mQueryRC = sqlite3_run_query(mdb,mStmt,5);
 }
 
 // Load the next row.  Return true if there is another row, false if finished or error.
@@ -128,23 +233,26 @@ bool sqlQuery::sqlStep()
 sqlQuery::sqlQuery(sqlite3*db, const char *tableName,const char *resultColumns,const char *condition)
 {
 	queryStart(db,tableName,resultColumns,condition);
+	queryRun();
 }
 
 sqlQuery::sqlQuery(sqlite3*db, const char *tableName,const char *resultColumns,const char *keyName, unsigned keyData)
 {
-	char conditionBuffer[sqlBufferSize];
-	queryStart(db,tableName,resultColumns,condition_u(conditionBuffer,keyName,keyData));
+	queryStart(db,tableName,resultColumns,format("WHERE %s == ?",keyName).c_str());
+	if (mStmt) sqlite3_bind_int64(mStmt,1,keyData);
+	queryRun();
 }
 
 sqlQuery::sqlQuery(sqlite3*db, const char *tableName,const char *resultColumns,const char *keyName, const char *keyData)
 {
-	char conditionBuffer[sqlBufferSize];
-	queryStart(db,tableName,resultColumns,condition_c(conditionBuffer,keyName,keyData));
+	queryStart(db,tableName,resultColumns,format("WHERE %s == ?",keyName).c_str());
+	if (mStmt) sqlite3_bind_text(mStmt,1,keyData,-1,SQLITE_TRANSIENT);
+	queryRun();
 }
 
 sqlQuery::~sqlQuery()
 {
-	if (mStmt) sqlite3_finalize(mStmt);
+	if (mStmt) sqlite_statement_release(mStmt);
 }
 
 string sqlQuery::getResultText(int colNum)
@@ -166,17 +274,13 @@ sqlite3_int64 sqlQuery::getResultInt(int colNum)
 bool sqlite3_exists(sqlite3* DB, const char *tableName,
 		const char* keyName, const char* keyData, unsigned retries)
 {
-	size_t stringSize = 100 + strlen(tableName) + strlen(keyName) + strlen(keyData);
-	char query[stringSize];
-	sprintf(query,"SELECT * FROM %s WHERE %s == \"%s\"",tableName,keyName,keyData);
 	// Prepare the statement.
-	sqlite3_stmt *stmt;
-	if (sqlite3_prepare_statement(DB,&stmt,query,retries)) return false;
+	sqlStatement stmt(DB,format("SELECT * FROM %s WHERE %s == ?",tableName,keyName).c_str(),retries);
+	if (!stmt.ok()) return false;
+	stmt.bindText(1,keyData);
 	// Read the result.
-	int src = sqlite3_run_query(DB,stmt,retries);
-	sqlite3_finalize(stmt);
 	// Anything there?
-	return (src == SQLITE_ROW);
+	return (stmt.step(retries) == SQLITE_ROW);
 }
 
 
@@ -185,21 +289,16 @@ bool sqlite3_single_lookup(sqlite3* DB, const char *tableName,
 		const char* keyName, const char* keyData,
 		const char* valueName, unsigned &valueData, unsigned retries)
 {
-	size_t stringSize = 100 + strlen(valueName) + strlen(tableName) + strlen(keyName) + strlen(keyData);
-	char query[stringSize];
-	sprintf(query,"SELECT %s FROM %s WHERE %s == \"%s\"",valueName,tableName,keyName,keyData);
 	// Prepare the statement.
-	sqlite3_stmt *stmt;
-	if (sqlite3_prepare_statement(DB,&stmt,query,retries)) return false;
+	sqlStatement stmt(DB,format("SELECT %s FROM %s WHERE %s == ?",valueName,tableName,keyName).c_str(),retries);
+	if (!stmt.ok()) return false;
+	stmt.bindText(1,keyData);
 	// Read the result.
-	int src = sqlite3_run_query(DB,stmt,retries);
-	bool retVal = false;
-	if (src == SQLITE_ROW) {
-		valueData = (unsigned)sqlite3_column_int64(stmt,0);
-		retVal = true;
+	if (stmt.step(retries) == SQLITE_ROW) {
+		valueData = (unsigned)sqlite3_column_int64(stmt.stmt(),0);
+		return true;
 	}
-	sqlite3_finalize(stmt);
-	return retVal;
+	return false;
 }
 
 #if 0	// This code works fine, but sqlQuery is a better way.
@@ -317,22 +416,17 @@ bool sqlite3_single_lookup(sqlite3* DB, const char* tableName,
 		const char* valueName, char* &valueData, unsigned retries)
 {
 	valueData=NULL;
-	size_t stringSize = 100 + strlen(valueName) + strlen(tableName) + strlen(keyName) + strlen(keyData);
-	char query[stringSize];
-	snprintf(query,stringSize,"SELECT %s FROM %s WHERE %s == \"%s\"",valueName,tableName,keyName,keyData);
 	// Prepare the statement.
-	sqlite3_stmt *stmt;
-	if (sqlite3_prepare_statement(DB,&stmt,query,retries)) return false;
+	sqlStatement stmt(DB,format("SELECT %s FROM %s WHERE %s == ?",valueName,tableName,keyName).c_str(),retries);
+	if (!stmt.ok()) return false;
+	stmt.bindText(1,keyData);
 	// Read the result.
-	int src = sqlite3_run_query(DB,stmt,retries);
-	bool retVal = false;
-	if (src == SQLITE_ROW) {
-		const char* ptr = (const char*)sqlite3_column_text(stmt,0);
+	if (stmt.step(retries) == SQLITE_ROW) {
+		const char* ptr = (const char*)sqlite3_column_text(stmt.stmt(),0);
 		if (ptr) valueData = strdup(ptr);
-		retVal = true;
+		return true;
 	}
-	sqlite3_finalize(stmt);
-	return retVal;
+	return false;
 }
 
 
@@ -342,22 +436,17 @@ bool sqlite3_single_lookup(sqlite3* DB, const char* tableName,
 		const char* valueName, char* &valueData, unsigned retries)
 {
 	valueData=NULL;
-	size_t stringSize = 100 + strlen(valueName) + strlen(tableName) + strlen(keyName) + 20;
-	char query[stringSize];
-	sprintf(query,"SELECT %s FROM %s WHERE %s == %u",valueName,tableName,keyName,keyData);
 	// Prepare the statement.
-	sqlite3_stmt *stmt;
-	if (sqlite3_prepare_statement(DB,&stmt,query,retries)) return false;
+	sqlStatement stmt(DB,format("SELECT %s FROM %s WHERE %s == ?",valueName,tableName,keyName).c_str(),retries);
+	if (!stmt.ok()) return false;
+	stmt.bindInt(1,keyData);
 	// Read the result.
-	int src = sqlite3_run_query(DB,stmt,retries);
-	bool retVal = false;
-	if (src == SQLITE_ROW) {
-		const char* ptr = (const char*)sqlite3_column_text(stmt,0);
+	if (stmt.step(retries) == SQLITE_ROW) {
+		const char* ptr = (const char*)sqlite3_column_text(stmt.stmt(),0);
 		if (ptr) valueData = strdup(ptr);
-		retVal = true;
+		return true;
 	}
-	sqlite3_finalize(stmt);
-	return retVal;
+	return false;
 }
 
 bool sqlite_set_attr(sqlite3*db,const char *attr_name,const char*attr_value)
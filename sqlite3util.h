@@ -35,12 +35,48 @@ extern const char *enableWAL;
 //	"PRAGMA journal_mode=WAL"
 //};
 
+/**@name The prepared statement cache.
+	Statements are kept per connection and sql text, and reused after sqlite3_reset instead of being prepared again.
+	Write the sql with a ? for each value and bind the values, so the text is the same every time;
+	binding also takes care of quoting.  The cache belongs to the connection, so a connection used with the cache,
+	which includes all the lookup functions below, must be closed with sqlite_close(), which finalizes its statements.
+*/
+//@{
+/** Get a prepared statement for sql on DB from the cache, or prepare a new one.  Returns NULL if the sql does not compile. */
+sqlite3_stmt *sqlite_statement_acquire(sqlite3* DB, const char *sql, unsigned retries = 5);
+/** Reset the statement, clear its bindings and give it back to the cache. */
+void sqlite_statement_release(sqlite3_stmt *stmt);
+/** Finalize the cached statements of DB and close it with sqlite3_close. */
+int sqlite_close(sqlite3* DB);
+
+/** A statement from the cache for as long as this exists. */
+class sqlStatement {
+	sqlite3_stmt *mStmt;
+	sqlStatement(const sqlStatement&);
+	sqlStatement& operator=(const sqlStatement&);
+
+	public:
+	sqlStatement(sqlite3* DB, const char *sql, unsigned retries = 5) : mStmt(sqlite_statement_acquire(DB,sql,retries)) {}
+	~sqlStatement() { if (mStmt) sqlite_statement_release(mStmt); }
+	/** Did the sql compile? */
+	bool ok() const { return mStmt != NULL; }
+	sqlite3_stmt *stmt() const { return mStmt; }
+	/** Bind the value of the index'th ?, counting from 1. */
+	bool bindText(int index, const char *text) { return sqlite3_bind_text(mStmt,index,text,-1,SQLITE_TRANSIENT) == SQLITE_OK; }
+	bool bindText(int index, const std::string &text) { return sqlite3_bind_text(mStmt,index,text.data(),text.size(),SQLITE_TRANSIENT) == SQLITE_OK; }
+	bool bindInt(int index, sqlite3_int64 value) { return sqlite3_bind_int64(mStmt,index,value) == SQLITE_OK; }
+	/** Run or continue the statement with sqlite3_run_query; returns SQLITE_ROW, SQLITE_DONE or an error. */
+	int step(unsigned retries = 5);
+};
+//@}
+
 // Pat added.
 class sqlQuery {
 	sqlite3 *mdb;
 	sqlite3_stmt *mStmt;
 	int mQueryRC;
 	void queryStart(sqlite3*db, const char *tableName,const char *condition, const char*resultCols);
+	void queryRun();
 
 	public:
 	std::string mQueryString;